@@ -30,33 +30,368 @@
 /*
  * nsloopctl.c --
  *
- *      Replacements for the "for", "while", and "foreach" commands to be
- *      monitored and managed by "loopctl_*" commands. Monitor threads
- *      with interps and send Tcl async cancel messages.
+ *      Replacements for the "for", "while", "foreach", "lmap", and
+ *      "dict for" commands to be monitored and managed by "loopctl_*"
+ *      commands. Monitor threads with interps and send Tcl async
+ *      cancel messages.
  */
 
 #include "ns.h"
 
 NS_EXPORT int Ns_ModuleVersion = 1;
 NS_EXPORT Ns_ModuleInitProc Ns_ModuleInit;
+
+/*
+ * Resource budget of a loop. Zero values mean unlimited.
+ */
+
+typedef struct Budget {
+    unsigned int spins;     /* Max number of iterations. */
+    Ns_Time      time;      /* Max elapsed time since loop entry. */
+} Budget;
+
+/*
+ * Number of spins between two clock readings for a time budget.
+ */
+
+#define LOOPCTL_CLOCK_SPINS 16u
+
+/*
+ * Control requests are polled every "checkevery" spins. An adaptive
+ * granularity polls about every LOOPCTL_POLL_USEC microseconds, based
+ * on the measured time per spin.
+ */
+
+#define LOOPCTL_GRANULARITY_MAX 1024u
+#define LOOPCTL_POLL_USEC       1000.0
+
+/*
+ * Spin rate history of a loop. A sample is taken every "stride"
+ * spins, where the stride adapts to the loop rate such that samples
+ * are between 100ms and 1s apart.
+ */
+
+#define LOOPCTL_SAMPLES     8u
+#define LOOPCTL_STRIDE_MAX  (1u << 24)
+
+typedef struct Sample {
+    Ns_Time      time;
+    uint64_t     spins;
+} Sample;
+
+/*
+ * Loop selection criteria of loopctl_stats and of the batch forms of
+ * the loop control commands.
+ */
+
+typedef struct Selector {
+    char         *thread;        /* Thread id, or NULL for all threads. */
+    uintptr_t     tid;
+    Ns_Time      *minElapsedPtr; /* Min run time of the loop, or NULL. */
+    int           minSpins;      /* Min number of spins. */
+    char         *pattern;       /* Glob pattern for the command, or NULL. */
+    Ns_Time       now;
+    unsigned int  first, last;   /* Range of shards to visit. */
+} Selector;
+
+/*
+ * Profile of a loop call site, identified by a hash of the loop command
+ * and body. Loop run times are counted in log2 buckets of microseconds,
+ * bucket i (i > 0) holding run times below 2^i us. The sites of a
+ * thread are updated by the thread without lock and read by
+ * loopctl_profile, new sites are inserted under the lock of the shard.
+ * A reset only bumps the profile epoch of the thread, the thread clears
+ * a site of an older epoch on its next update.
+ */
+
+#define LOOPCTL_BUCKETS 32u
+
+typedef struct Site {
+    uint64_t     count;     /* Number of loops run. */
+    uint64_t     spins;     /* Total iterations. */
+    uint64_t     usec;      /* Total run time. */
+    uint64_t     maxUsec;   /* Max run time. */
+    uint64_t     hist[LOOPCTL_BUCKETS]; /* Number of loops per bucket. */
+    unsigned int epoch;     /* Profile epoch of the counters. */
+    char        *label;     /* Command and args of the first loop. */
+} Site;
+
+#define LOOPCTL_SITE_KEY (sizeof(uint64_t) / sizeof(int))
+
+/*
+ * The site of a loop is looked up by the objects of its command and
+ * body, such that the hash of the site is computed once per body.
+ * Literals like "{}" are shared by commands, hence the pair. The cache
+ * holds a reference to both objects, so that their address is not
+ * reused, and is flushed when full or when an interp is deleted.
+ */
+
+typedef struct BodyKey {
+    Tcl_Obj *cmdPtr;
+    Tcl_Obj *bodyPtr;
+} BodyKey;
+
+#define LOOPCTL_BODY_KEY (sizeof(BodyKey) / sizeof(int))
+#define LOOPCTL_BODIES   1024
+
+/*
+ * Sort key of a site for loopctl_profile.
+ */
+
+typedef struct SiteRank {
+    uint64_t    key;
+    const Site *sitePtr;
+} SiteRank;
+
+/*
+ * Histograms of the loops of a virtual server run in a thread, with
+ * the same log2 buckets of the loop run time in microseconds and of
+ * the time per spin in nanoseconds. The counters are written by the
+ * owning thread only. The list is extended and read by
+ * loopctl_histogram under the lock of the shard of the thread.
+ */
+
+typedef struct Histogram {
+    struct Histogram       *nextPtr;
+    const struct ServerData *serverPtr;
+    uint64_t                duration[LOOPCTL_BUCKETS];
+    uint64_t                itertime[LOOPCTL_BUCKETS];
+} Histogram;
+
+#ifndef TCL_SIZE_MAX
+# define TCL_SIZE_MAX INT_MAX
+#endif
+
+/*
+ * The CPU time of a thread can be read from other threads, when POSIX
+ * thread CPU-time clocks are available. Otherwise, CPU times are 0.
+ */
+
+#if defined(_POSIX_THREAD_CPUTIME) && _POSIX_THREAD_CPUTIME >= 0
+# define LOOPCTL_CPUTIME 1
+#endif
+
+/*
+ * Relaxed loads and stores for fields which are written under the lock
+ * but polled by the loop thread without it. The ordered variants
+ * publish the slots of the event log.
+ */
+
+#if defined(__GNUC__) || defined(__clang__)
+# define LOOPCTL_LOAD(ptr)         __atomic_load_n((ptr), __ATOMIC_RELAXED)
+# define LOOPCTL_STORE(ptr, value) __atomic_store_n((ptr), (value), __ATOMIC_RELAXED)
+# define LOOPCTL_LOAD64            LOOPCTL_LOAD
+# define LOOPCTL_STORE64           LOOPCTL_STORE
+# define LOOPCTL_INCR(ptr)         __atomic_fetch_add((ptr), 1u, __ATOMIC_RELAXED)
+# define LOOPCTL_CLAIM64(ptr)      __atomic_add_fetch((ptr), 1u, __ATOMIC_RELAXED)
+# define LOOPCTL_ACQUIRE64(ptr)    __atomic_load_n((ptr), __ATOMIC_ACQUIRE)
+# define LOOPCTL_RELEASE64(ptr, value) __atomic_store_n((ptr), (value), __ATOMIC_RELEASE)
+# define LOOPCTL_FENCE_ACQUIRE()   __atomic_thread_fence(__ATOMIC_ACQUIRE)
+# define LOOPCTL_FENCE_RELEASE()   __atomic_thread_fence(__ATOMIC_RELEASE)
+#else
+# define LOOPCTL_LOAD(ptr)         (*(volatile int *)(ptr))
+# define LOOPCTL_STORE(ptr, value) (*(volatile int *)(ptr) = (value))
+# define LOOPCTL_LOAD64(ptr)         (*(volatile uint64_t *)(ptr))
+# define LOOPCTL_STORE64(ptr, value) (*(volatile uint64_t *)(ptr) = (value))
+# define LOOPCTL_INCR(ptr)           (*(volatile uint64_t *)(ptr) += 1u)
+# define LOOPCTL_CLAIM64             LOOPCTL_INCR
+# define LOOPCTL_ACQUIRE64           LOOPCTL_LOAD64
+# define LOOPCTL_RELEASE64           LOOPCTL_STORE64
+# define LOOPCTL_FENCE_ACQUIRE()     ((void)0)
+# define LOOPCTL_FENCE_RELEASE()     ((void)0)
+#endif
+
+/*
+ * Module-wide event counters, reported by loopctl_metrics. Every shard
+ * has its own set, incremented by the threads assigned to the shard,
+ * such that counting loop entries does not contend on a single cache
+ * line.
+ */
+
+typedef enum {
+    COUNT_LOOPS,
+    COUNT_PAUSES,
+    COUNT_THROTTLES,
+    COUNT_CANCELS,
+    COUNT_BUDGETS,
+    COUNT_EVALS,
+    COUNT_EVAL_TIMEOUTS,
+    COUNT_EVAL_DROPS,
+    COUNT_ABORTS,
+    COUNT_STALLS,
+    COUNT_HOGS,
+    COUNT_MAX
+} Counter;
+
+static const char *const counterNames[COUNT_MAX] = {
+    "loops", "pauses", "throttles", "cancels", "budgets",
+    "evals", "evaltimeouts", "evaldrops", "aborts", "stalls", "hogs"
+};
+
+/*
+ * Ring buffer of loop lifecycle events of a virtual server, read by
+ * loopctl_events. Writers claim a sequence number with an atomic
+ * increment of the head and publish the slot by storing its sequence
+ * number last, such that no lock is taken. Readers copy a slot and
+ * drop it when its sequence number changed meanwhile. Sequence
+ * numbers start at 1, a slot with sequence 0 is being written. Enter
+ * and leave of the loops are only logged with "eventloops", since
+ * they would claim the head all the time and push the control
+ * events out of the log.
+ */
+
+typedef enum {
+    EVENT_ENTER,
+    EVENT_LEAVE,
+    EVENT_PAUSE,
+    EVENT_RESUME,
+    EVENT_THROTTLE,
+    EVENT_CANCEL,
+    EVENT_EVAL,
+    EVENT_EVAL_DROP,
+    EVENT_ABORT
+} EventType;
+
+static const char *const eventNames[] = {
+    "enter", "leave", "pause", "resume", "throttle", "cancel",
+    "eval", "evaldrop", "abort"
+};
+
+#define LOOPCTL_EVENT_CMD 64u
+
+typedef struct Event {
+    uint64_t       seq;     /* Sequence number, 0 while written. */
+    Ns_Time        time;
+    uintptr_t      lid;
+    uintptr_t      tid;
+    uint64_t       spins;
+    EventType      type;
+    char           command[LOOPCTL_EVENT_CMD]; /* Prefix of the command args. */
+} Event;
+
+typedef struct EventLog {
+    uint64_t       head;    /* Last claimed sequence number. */
+    uint64_t       mask;    /* Number of slots - 1, slots is a power of two. */
+    Event         *slots;
+} EventLog;
+
+#define LOOPCTL_EVENTS_MAX (1 << 20)
+
+/*
+ * Escalation of the loops found stalled or hogging the CPU by the
+ * monitor thread, selected by the "stallaction" and "hogaction"
+ * parameters.
+ */
+
+typedef enum {
+    MONITOR_LOG,
+    MONITOR_CANCEL,
+    MONITOR_ABORT
+} MonitorAction;
+
+static const char *const monitorActions[] = {
+    "log", "cancel", "abort"
+};
+
+/*
+ * The following structure keeps the module configuration of a
+ * virtual server.
+ */
+
+typedef struct ServerData {
+    const char *server;     /* Name of the virtual server. */
+    bool        fullArgs;   /* Copy complete command args. */
+    TCL_SIZE_T  argSize;    /* Max bytes captured per arg otherwise. */
+    unsigned int registerAfter; /* Spins before a loop gets registered. */
+    unsigned int checkEvery; /* Spins between control polls, 0 if adaptive. */
+    unsigned int loopCmds;  /* Bitmask of replaced loop commands. */
+    TCL_SIZE_T  limitCommands; /* Command limit granularity, 0 if disabled. */
+    Budget      budget;     /* Default budget of every loop. */
+    Ns_Time     evalTimeout; /* Default timeout waiting for eval results. */
+    Ns_Time     maxPause;   /* Max time a loop stays paused, 0 if unbounded. */
+    bool        profile;    /* Aggregate loop statistics per call site. */
+    bool        histograms; /* Record histograms of loop run times. */
+    Ns_Time     monitorInterval; /* Pass interval of the monitor thread, 0 if disabled. */
+    Ns_Time     stallTime;  /* Time without a spin after which a loop is stalled. */
+    int         hogRate;    /* Spins per second of a hog, 0 if not checked. */
+    MonitorAction stallAction;
+    MonitorAction hogAction;
+    Ns_Mutex    monitorLock; /* Lock around monitorStop. */
+    Ns_Cond     monitorCond; /* Wake the monitor thread to stop. */
+    bool        monitorStop;
+    Ns_Thread   monitorThread;
+    EventLog   *eventLogPtr; /* Recent loop lifecycle events, NULL if disabled. */
+    bool        eventLoops; /* Log enter and leave of every loop as well. */
+} ServerData;
+
 /*
  * The following structure supports sending a script to a
- * loop to eval.
+ * loop to eval. Requests are reference counted, since they are
+ * shared by the loop, the handle of an async request and the
+ * threads waiting for the result. All fields are protected by the
+ * lock of the shard of the loop.
+ */
+
+#define LOOPCTL_MAX_EVALS 16
+
+/*
+ * Max number of async eval handles per shard. Handles whose result was
+ * not collected within the "evaltimeout" after completion are expired.
+ */
+
+#define LOOPCTL_MAX_HANDLES 1024
+
+/*
+ * Max number of eval scripts cached per interp as Tcl_Objs, such that
+ * the byte code of repeated scripts is reused.
  */
 
+#define LOOPCTL_SCRIPTS   32
+
 typedef struct EvalData {
+    struct EvalData *nextPtr; /* Next request queued for the loop. */
     enum {
         EVAL_WAIT,
+        EVAL_RUN,
         EVAL_DONE,
         EVAL_DROP
     } state;                /* Eval request state. */
 
+    int         refCount;   /* Holders of this request. */
     int         code;       /* Script result code. */
+    Ns_Cond     cond;       /* Wait for evaluation to complete. */
+    struct Shard *shardPtr; /* Shard of the loop. */
+    Tcl_HashEntry *hPtr;    /* Entry in evals table, NULL if not async. */
+    Ns_Time     keepTime;   /* Time an async result is kept after completion. */
+    Ns_Time     doneTime;   /* Time of completion. */
     Tcl_DString script;     /* Script buffer. */
     Tcl_DString result;     /* Result buffer. */
 
 } EvalData;
 
+/*
+ * The registries of running loops and of threads with interps are split
+ * into shards, each with its own lock. A thread is assigned to a shard
+ * by hashing its thread id and registers all its loops there, such that
+ * entering and leaving loops in different threads does not serialize on
+ * a single mutex. The shard index is encoded in the low bits of the loop
+ * id to find the loop again.
+ */
+
+#define LOOPCTL_SHARD_BITS 4
+#define LOOPCTL_SHARDS     (1u << LOOPCTL_SHARD_BITS)
+
+typedef struct Shard {
+    Ns_Mutex       lock;     /* Lock around loops and threads tables. */
+    Tcl_HashTable  loops;    /* Currently running loops. */
+    Tcl_HashTable  threads;  /* Running threads with interps allocated. */
+    Tcl_HashTable  evals;    /* Handles of async eval requests. */
+    Tcl_HashTable  sites;    /* Profile of exited threads. */
+    Histogram     *histPtr;  /* Histograms of exited threads. */
+    uint64_t       counts[COUNT_MAX]; /* Event counters, updated atomically. */
+    uintptr_t      next;     /* Next loop or eval sequence number. */
+} Shard;
+
 /*
  * The following structure is allocated for the "while"
  * and "for" commands to maintain a copy of the current
@@ -65,32 +400,153 @@ typedef struct EvalData {
 typedef enum {
     LOOP_RUN,
     LOOP_PAUSE,
-    LOOP_CANCEL
+    LOOP_CANCEL,
+    LOOP_THROTTLE
 } LoopControl;
 
+/*
+ * Throttle of a loop. Zero values mean unlimited.
+ */
+
+typedef struct Throttle {
+    int   rate;             /* Max spins per second. */
+    int   duty;             /* Max percentage of time spent running. */
+} Throttle;
+
 typedef struct LoopData {
     LoopControl    control;              /* Loop control commands. */
+    int            attention; /* Control or eval pending, polled without lock. */
+    bool           cancelSent; /* Cancel delivered by the limit engine. */
+    bool           abortSent; /* Interp canceled by loopctl_abort -loop, under lock. */
+    Ns_Time        controlUntil; /* End of a bounded pause or throttle, 0 if unbounded. */
 
-    char           lid[32]; /* Unique loop id. */
+    uintptr_t      lid;     /* Unique loop id. */
     uintptr_t      tid;     /* Thread id of script. */
-    unsigned int   spins;   /* Loop iterations. */
+    uint64_t       spins;   /* Loop iterations, stored atomically by loop thread only. */
+    uint64_t       nextCheck; /* Spins at which to leave the fast path. */
+    uint64_t       nextPoll; /* Spins at which to poll attention next. */
+    unsigned int   granularity; /* Spins between polls, 0 if adaptive. */
+    unsigned int   pollEvery; /* Spins between polls in effect. */
+    unsigned int   newGranularity; /* Granularity set by loopctl_granularity. */
+    bool           granularityChanged;
+    uint64_t       nextSample; /* Spins at which to take the next sample. */
+    unsigned int   stride;  /* Spins between samples. */
+    unsigned int   nsamples; /* Samples taken, updated under lock. */
+    Sample         samples[LOOPCTL_SAMPLES]; /* Ring of recent samples. */
     Ns_Time        etime;   /* Loop entry time. */
-    Tcl_HashEntry *hPtr;    /* Entry in active loop table. */
+    Ns_Time        wallStart; /* Wall time at registration. */
+    Ns_Time        cpuStart; /* Thread CPU time at registration. */
+    Ns_Time        cpu;     /* CPU time since registration at the last sample. */
+    Budget         budget;  /* Budget, updated by loop thread under lock. */
+    Ns_Time        deadline; /* Entry time plus time budget. */
+    Throttle       throttle; /* Throttle set by loopctl_throttle, under lock. */
+    Throttle       active;  /* Throttle applied by the loop thread. */
+    Ns_Time        activeUntil; /* Copy of controlUntil for the active throttle. */
+    double         tokens;  /* Token bucket of the spin rate. */
+    Ns_Time        lastSpin; /* End of the last throttle delay. */
+    Budget         newBudget; /* Budget set by loopctl_budget. */
+    bool           budgetChanged;
+    const ServerData *serverPtr; /* Module config of the interp. */
+    Tcl_Interp    *interp;  /* Interp running the loop. */
+    TCL_SIZE_T     objc;    /* Command args, captured on registration. */
+    Tcl_Obj *const *objv;
+    Shard         *shardPtr; /* Registry shard of the loop thread. */
+    struct ThreadData *threadPtr; /* Context of the loop thread. */
+    struct LoopData *parentPtr; /* Next outer registered loop of the thread. */
+    unsigned int   depth;   /* Nesting level of registered loops, 1 for the outermost. */
+    uint64_t       monSpins; /* Spins at the last pass of the monitor thread. */
+    Ns_Time        monTime; /* Time of the last pass of the monitor thread. */
+    Ns_Time        monProgress; /* Time at which the monitor last saw a spin. */
+    unsigned int   monFlags; /* Conditions reported by the monitor thread. */
+    Tcl_HashEntry *hPtr;    /* Entry in active loop table, NULL until registered. */
     Tcl_DString    args;    /* Copy of command args. */
-    EvalData      *evalPtr; /* Eval request pending. */
+    EvalData      *evalPtr; /* Queue of pending eval requests. */
 
 } LoopData;
 
+/*
+ * Per-thread free lists of the memory needed on loop entry and exit,
+ * e.g. the arrays of a "foreach" over many lists and eval requests.
+ * Blocks are kept in power of two size classes from 64 bytes up,
+ * larger ones are not recycled. Spilled Tcl_DString buffers of the
+ * captured args are recycled separately, as Tcl may reallocate them.
+ * The lists are only touched by their thread and need no locking.
+ */
+
+#define LOOPCTL_ARENA_CLASSES 8u
+#define LOOPCTL_ARENA_MIN     64u
+#define LOOPCTL_ARENA_KEEP    8u
+
+typedef union Block {
+    union Block  *nextPtr;  /* Next free block of the size class. */
+    size_t        cls;      /* Size class of an allocated block. */
+    double        align;
+} Block;
+
+typedef struct Arena {
+    Block        *blocks[LOOPCTL_ARENA_CLASSES]; /* Free blocks per size class. */
+    unsigned int  nblocks[LOOPCTL_ARENA_CLASSES];
+    char         *strings[LOOPCTL_ARENA_KEEP];   /* Free Tcl_DString buffers. */
+    TCL_SIZE_T    sizes[LOOPCTL_ARENA_KEEP];
+    unsigned int  nstrings;
+} Arena;
+
 /*
  * The following structure maintains per-thread context to support
- * a shared async cancel object.
+ * a shared async cancel object. Since a thread can only wait in its
+ * innermost loop, a single condition per thread is sufficient to wake
+ * a paused loop without disturbing the loops of other threads. The
+ * registered loops of the thread form a stack, linked from the
+ * innermost one via their parentPtr.
  */
 
 typedef struct ThreadData {
     Tcl_AsyncHandler  cancel;
+    Ns_Cond           cond;     /* Wait for a paused loop to resume. */
+    Shard            *shardPtr; /* Registry shard of this thread. */
     Tcl_HashEntry    *hPtr;    /* Self reference to threads table. */
+    LoopData         *loopPtr;  /* Innermost registered loop. */
+    LoopData         *outerPtr; /* Outermost registered loop. */
+    unsigned int      cancelDepth; /* Depth of the outermost canceled loop, 0 if none. */
+    Ns_Time           abortSent; /* Time of the last abort request, 0 if none. */
+    Ns_Time           abortAck; /* Time the abort was delivered, 0 if pending. */
+    int               attention; /* Work for the limit engine, polled without lock. */
+    bool              abort;    /* Abort requested via the limit engine. */
+    bool              limited;  /* Limit engine enabled in an interp of the thread. */
+    Ns_Time           start;    /* Wall time at registration. */
+    Ns_Time           cpuStart; /* Thread CPU time at registration. */
+    Tcl_HashTable     sites;    /* Profile of the loops run, inserts under lock of shard. */
+    Tcl_HashTable     bodies;   /* Sites by loop command and body, see BodyKey. */
+    unsigned int      profileEpoch; /* Bumped by loopctl_profile -reset. */
+    Histogram        *histPtr;  /* Histograms per server, added under lock of shard. */
+    Arena             arena;    /* Recycled memory of the thread. */
+#ifdef LOOPCTL_CPUTIME
+    clockid_t         clock;    /* CPU-time clock of the thread. */
+    bool              haveClock;
+#endif
 } ThreadData;
 
+/*
+ * Specialized evaluation of the common loop condition "$i < $n" or
+ * "$i < 100", with any comparison operator, and of the next clause
+ * "incr i ?step?" of "for". The fast path is only taken when the
+ * variables hold integers and "incr" is the builtin, otherwise the
+ * generic expression engine or command evaluation is used.
+ */
+
+typedef enum {
+    FAST_LT, FAST_LE, FAST_GT, FAST_GE, FAST_EQ, FAST_NE
+} FastOp;
+
+typedef struct FastLoop {
+    Tcl_Obj     *varPtr;      /* Left operand of the condition, or NULL. */
+    Tcl_Obj     *limitVarPtr; /* Right operand, or NULL if constant. */
+    Tcl_WideInt  limit;
+    FastOp       op;
+    Tcl_Obj     *incrVarPtr;  /* Variable of the next clause, or NULL. */
+    Tcl_WideInt  step;
+} FastLoop;
+
 
 /*
  * Static procedures defined in this file.
@@ -99,42 +555,155 @@ typedef struct ThreadData {
 static TCL_OBJCMDPROC_T
     LoopsObjCmd,
     InfoObjCmd,
+    StatsObjCmd,
+    ProfileObjCmd,
+    HistogramObjCmd,
+    MetricsObjCmd,
+    BudgetObjCmd,
+    GranularityObjCmd,
+    EventsObjCmd,
     EvalObjCmd,
+    WaitObjCmd,
+    ResultObjCmd,
     PauseObjCmd,
     RunObjCmd,
     CancelObjCmd,
+    ThrottleObjCmd,
     ThreadsObjCmd,
     AbortObjCmd;
 
 static TCL_OBJCMDPROC_T
     ForObjCmd,
     WhileObjCmd,
-    ForeachObjCmd;
+    ForeachObjCmd,
+    LmapObjCmd,
+    DictForObjCmd;
 
-static Ns_TclTraceProc InitInterp;
+static Ns_TclTraceProc InitInterp, FreeInterp, DeleteInterp;
+static Tcl_LimitHandlerProc LimitHandler;
 static Ns_TlsCleanup   ThreadCleanup;
+static Ns_ThreadProc   MonitorThread;
+static Ns_ShutdownProc StopMonitor;
 static Tcl_AsyncProc   ThreadAbort;
+static Tcl_InterpDeleteProc FreeScripts;
 
 static int CheckControl(Tcl_Interp *interp, LoopData *loopPtr);
-static void EnterLoop(LoopData *loopPtr, TCL_SIZE_T objc, Tcl_Obj * const objv[]);
+static void EnterLoop(const ServerData *serverPtr, Tcl_Interp *interp, LoopData *loopPtr,
+                      TCL_SIZE_T objc, Tcl_Obj * const objv[]);
+static void RegisterLoop(LoopData *loopPtr);
+static void SetBudget(LoopData *loopPtr, const Budget *budgetPtr);
+static uint64_t NextCheck(const LoopData *loopPtr);
+static void TakeSample(LoopData *loopPtr, const Ns_Time *nowPtr);
+static void AppendRate(Tcl_DString *dsPtr, const LoopData *loopPtr, const Ns_Time *nowPtr);
+static int CheckBudget(Tcl_Interp *interp, LoopData *loopPtr);
+static void AppendArg(Tcl_DString *dsPtr, Tcl_Obj *objPtr, TCL_SIZE_T size, bool nested);
 static void LeaveLoop(LoopData *loopPtr);
-
+static void AppendArgs(Tcl_DString *dsPtr, const ServerData *serverPtr, TCL_SIZE_T objc,
+                       Tcl_Obj *const objv[]);
+static void ProfileLoop(const LoopData *loopPtr, ThreadData *threadPtr, uint64_t usec);
+static void RecordLoop(const LoopData *loopPtr, ThreadData *threadPtr, uint64_t usec);
+static void MergeHistograms(Histogram **histPtrPtr, const Histogram *fromPtr);
+static void MergeSites(Tcl_HashTable *tablePtr, Tcl_HashTable *fromPtr, const unsigned int *epochPtr);
+static int CompareRank(const void *a, const void *b);
+static Tcl_Obj *HistogramObj(const uint64_t *buckets);
+static void FreeSites(Tcl_HashTable *tablePtr);
+static void FlushBodies(Tcl_HashTable *tablePtr);
+static unsigned int Log2Bucket(uint64_t value);
+
+static int ThreadStats(Tcl_Interp *interp);
 static int List(ClientData arg, Tcl_Interp *interp, TCL_SIZE_T objc, Tcl_Obj *const objv[],
-                Tcl_HashTable *tablePtr);
+                size_t tableOffset);
+static int EachLoop(ClientData clientData, Tcl_Interp *interp, TCL_SIZE_T objc, Tcl_Obj *const objv[],
+                    bool collect);
+static Tcl_Obj *ShareList(Tcl_Obj *listPtr, TCL_SIZE_T objc, Tcl_Obj *const objv[]);
+static int WaitResult(ClientData clientData, Tcl_Interp *interp, TCL_SIZE_T objc, Tcl_Obj *const objv[],
+                      bool collect);
 static int Signal(ClientData arg, Tcl_Interp *interp, TCL_SIZE_T objc, Tcl_Obj *const objv[],
                   LoopControl signal);
-static LoopData *GetLoop(Tcl_Interp *interp, Tcl_Obj *objPtr);
+static LoopData *GetLoop(Tcl_Interp *interp, Tcl_Obj *objPtr, Shard **shardPtrPtr);
+static EvalData *GetEval(Tcl_Interp *interp, Tcl_Obj *objPtr, Shard **shardPtrPtr);
+static void *GetEntry(Tcl_Interp *interp, Tcl_Obj *objPtr, size_t tableOffset,
+                      const char *what, Shard **shardPtrPtr);
+static Tcl_HashEntry *NewEntry(Shard *shardPtr, Tcl_HashTable *tablePtr, uintptr_t *idPtr);
+static Tcl_Obj *NewIdObj(uintptr_t id);
+static int GetId(Tcl_Interp *interp, Tcl_Obj *objPtr, uintptr_t *idPtr);
+static void WaitEval(EvalData *evalPtr, const Ns_Time *timeoutPtr);
+static int EvalResult(Tcl_Interp *interp, EvalData *evalPtr);
+static void ReleaseEval(EvalData *evalPtr);
+static void ExpireEvals(Shard *shardPtr, const Ns_Time *nowPtr);
+static Tcl_Obj *GetScript(Tcl_Interp *interp, const Tcl_DString *scriptPtr);
+static void FlushScripts(Tcl_HashTable *tablePtr);
+static Shard *GetShard(uintptr_t id);
+static const char *GetStatus(LoopControl control);
+static int InitSelector(Tcl_Interp *interp, Selector *selPtr);
+static bool MatchLoop(const LoopData *loopPtr, const Selector *selPtr, Ns_Time *elapsedPtr);
+static void SendSignal(LoopData *loopPtr, LoopControl signal, const Ns_Time *timeoutPtr,
+                       const Throttle *throttlePtr);
+static void ThrottleLoop(LoopData *loopPtr);
+static bool ControlExpired(LoopData *loopPtr, const Ns_Time *nowPtr);
+static bool Canceled(const LoopData *loopPtr);
+static ThreadData *GetThreadData(void);
+static void AbortThread(ThreadData *threadPtr);
+static void AckAbort(ThreadData *threadPtr);
+static int AbortLoop(Tcl_Interp *interp, Tcl_Obj *idObj);
+static void MonitorLoop(LoopData *loopPtr, const Ns_Time *nowPtr);
+static MonitorAction GetMonitorAction(const char *section, const char *key);
+static void *ArenaAlloc(ThreadData *threadPtr, size_t size);
+static void ArenaFree(ThreadData *threadPtr, void *ptr);
+static void ArenaInitString(ThreadData *threadPtr, Tcl_DString *dsPtr);
+static void ArenaFreeString(ThreadData *threadPtr, Tcl_DString *dsPtr);
+static void FreeArena(Arena *arenaPtr);
+static void CountEvent(Counter counter);
+static void LogEvent(EventType type, const LoopData *loopPtr);
+static void GetCpuTime(const ThreadData *threadPtr, Ns_Time *timePtr);
+static double CpuRatio(const Ns_Time *cpuPtr, const Ns_Time *startPtr, const Ns_Time *nowPtr);
+static TCL_SIZE_T GetCmdCount(Tcl_Interp *interp);
+static const char *ParseName(const char *p, Tcl_Obj **namePtrPtr);
+static const char *ParseInteger(const char *p, Tcl_WideInt *valuePtr);
+static void InitFastLoop(Tcl_Interp *interp, FastLoop *fastPtr, Tcl_Obj *condPtr, Tcl_Obj *nextPtr);
+static void FreeFastLoop(FastLoop *fastPtr);
+static int FastCondition(Tcl_Interp *interp, const FastLoop *fastPtr, int *valuePtr);
+static bool GetFastInt(Tcl_Obj *objPtr, Tcl_WideInt *valuePtr);
+static int FastIncr(Tcl_Interp *interp, const FastLoop *fastPtr);
 
 
 /*
  * Static variables defined in this file.
  */
 
-static Tcl_HashTable loops;        /* Currently running loops. */
-static Tcl_HashTable threads;      /* Running threads with interps allocated. */
+static Shard         shards[LOOPCTL_SHARDS]; /* Loop and thread registries. */
 static Ns_Tls        tls;          /* Slot for per-thread cancel cookie. */
-static Ns_Mutex      lock = NULL;  /* Lock around loops and threads tables. */
-static Ns_Cond       cond = NULL;  /* Wait for evaluation to complete. */
+
+/*
+ * Loop commands which can be replaced, selected by the "commands"
+ * parameter. The remaining ones keep their byte-compiled
+ * implementation from Tcl. The "dict for" subcommand is replaced by
+ * the implementation command of the "dict" ensemble.
+ */
+
+static const struct {
+    const char       *name;
+    const char       *cmd;
+    TCL_OBJCMDPROC_T *proc;
+} loopCmds[] = {
+    {"for",             "for",              ForObjCmd},
+    {"while",           "while",            WhileObjCmd},
+    {"foreach",         "foreach",          ForeachObjCmd},
+    {"lmap",            "lmap",             LmapObjCmd},
+    {"dict for",        "::tcl::dict::for", DictForObjCmd}
+};
+
+static Tcl_UpdateStringProc UpdateStringOfId;
+static Tcl_SetFromAnyProc   SetIdFromAny;
+
+static const Tcl_ObjType idType = {
+    "nsloopctl:id", NULL, NULL, UpdateStringOfId, SetIdFromAny
+};
+
+static Tcl_ObjCmdProc *incrProc;          /* Builtin "incr" for FastIncr. */
+
+static const Tcl_ObjType *listTypePtr;    /* Obj types which are rendered */
+static const Tcl_ObjType *scalarTypes[4]; /* on partial arg capture. */
 
 
 
@@ -156,17 +725,39 @@ static Ns_Cond       cond = NULL;  /* Wait for evaluation to complete. */
  */
 
 Ns_ReturnCode
-Ns_ModuleInit(const char *server, const char *UNUSED(module))
+Ns_ModuleInit(const char *server, const char *module)
 {
     static bool initialized = NS_FALSE;
+    unsigned int i;
+    ServerData  *serverPtr;
+    const char  *section, *cmds, **cmdv;
+    TCL_SIZE_T   cmdc, j;
+    int          n;
 
     Ns_MasterLock();
     if (!initialized) {
         initialized = NS_TRUE;
-        Ns_MutexSetName(&lock, "nsloopctl");
-        Tcl_InitHashTable(&loops, TCL_STRING_KEYS);
-        Tcl_InitHashTable(&threads, TCL_STRING_KEYS);
+        for (i = 0u; i < LOOPCTL_SHARDS; i++) {
+            Shard *shardPtr = &shards[i];
+            char   name[TCL_INTEGER_SPACE];
+
+            snprintf(name, sizeof(name), "%u", i);
+            Ns_MutexInit(&shardPtr->lock);
+            Ns_MutexSetName2(&shardPtr->lock, "nsloopctl", name);
+            Tcl_InitHashTable(&shardPtr->loops, TCL_ONE_WORD_KEYS);
+            Tcl_InitHashTable(&shardPtr->threads, TCL_STRING_KEYS);
+            Tcl_InitHashTable(&shardPtr->evals, TCL_ONE_WORD_KEYS);
+            Tcl_InitHashTable(&shardPtr->sites, (int)LOOPCTL_SITE_KEY);
+            shardPtr->histPtr = NULL;
+            memset(shardPtr->counts, 0, sizeof(shardPtr->counts));
+            shardPtr->next = 0u;
+        }
         Ns_TlsAlloc(&tls, ThreadCleanup);
+        listTypePtr = Tcl_GetObjType("list");
+        scalarTypes[0] = Tcl_GetObjType("int");
+        scalarTypes[1] = Tcl_GetObjType("wideInt");
+        scalarTypes[2] = Tcl_GetObjType("double");
+        scalarTypes[3] = Tcl_GetObjType("boolean");
     }
     Ns_MasterUnlock();
 
@@ -175,18 +766,96 @@ Ns_ModuleInit(const char *server, const char *UNUSED(module))
         return NS_ERROR;
     }
 
-    Ns_TclRegisterTrace(server, InitInterp, NULL, NS_TCL_TRACE_CREATE);
+    section = Ns_ConfigGetPath(server, module, NULL);
+    serverPtr = ns_malloc(sizeof(ServerData));
+    serverPtr->server = server;
+    serverPtr->fullArgs = Ns_ConfigBool(section, "fullargs", NS_FALSE);
+    serverPtr->argSize = Ns_ConfigIntRange(section, "argsize", 64, 16, INT_MAX);
+    serverPtr->registerAfter = (unsigned int)Ns_ConfigIntRange(section, "registerafter", 0, 0, INT_MAX);
+    serverPtr->checkEvery = (unsigned int)Ns_ConfigIntRange(section, "checkevery", 1, 0,
+                                                            (int)LOOPCTL_GRANULARITY_MAX);
+
+    serverPtr->loopCmds = 0u;
+    cmds = Ns_ConfigString(section, "commands", "for while foreach lmap {dict for}");
+    if (Tcl_SplitList(NULL, cmds, &cmdc, &cmdv) != TCL_OK) {
+        Ns_Log(Error, "nsloopctl: invalid list of commands: %s", cmds);
+        ns_free(serverPtr);
+        return NS_ERROR;
+    }
+    for (j = 0; j < cmdc; j++) {
+        for (i = 0u; i < sizeof(loopCmds) / sizeof(loopCmds[0]); i++) {
+            if (STREQ(cmdv[j], loopCmds[i].name)) {
+                serverPtr->loopCmds |= (1u << i);
+                break;
+            }
+        }
+        if (i == sizeof(loopCmds) / sizeof(loopCmds[0])) {
+            Ns_Log(Warning, "nsloopctl: ignoring unknown loop command: %s", cmdv[j]);
+        }
+    }
+    Tcl_Free((char *)cmdv);
+
+    serverPtr->budget.spins = (unsigned int)Ns_ConfigIntRange(section, "maxspins", 0, 0, INT_MAX);
+    Ns_ConfigTimeUnitRange(section, "maxtime", "0s", 0, 0, LONG_MAX, 0, &serverPtr->budget.time);
+    Ns_ConfigTimeUnitRange(section, "evaltimeout", "2s", 0, 0, LONG_MAX, 0, &serverPtr->evalTimeout);
+    Ns_ConfigTimeUnitRange(section, "maxpause", "0s", 0, 0, LONG_MAX, 0, &serverPtr->maxPause);
+    serverPtr->profile = Ns_ConfigBool(section, "profile", NS_FALSE);
+    serverPtr->histograms = Ns_ConfigBool(section, "histograms", NS_FALSE);
+    if (serverPtr->profile) {
+        Ns_TclRegisterTrace(server, DeleteInterp, serverPtr, NS_TCL_TRACE_DELETE);
+    }
+
+    serverPtr->limitCommands = Ns_ConfigIntRange(section, "limitcommands", 0, 0, INT_MAX);
+    if (serverPtr->limitCommands > 0) {
+        Ns_TclRegisterTrace(server, FreeInterp, serverPtr, NS_TCL_TRACE_DEALLOCATE);
+    }
+
+    Ns_ConfigTimeUnitRange(section, "monitorinterval", "0s", 0, 0, LONG_MAX, 0,
+                           &serverPtr->monitorInterval);
+    Ns_ConfigTimeUnitRange(section, "stalltime", "10s", 0, 1, LONG_MAX, 0, &serverPtr->stallTime);
+    serverPtr->hogRate = Ns_ConfigIntRange(section, "hograte", 0, 0, INT_MAX);
+    serverPtr->stallAction = GetMonitorAction(section, "stallaction");
+    serverPtr->hogAction = GetMonitorAction(section, "hogaction");
+    if (serverPtr->monitorInterval.sec > 0 || serverPtr->monitorInterval.usec > 0) {
+        Ns_MutexInit(&serverPtr->monitorLock);
+        Ns_MutexSetName2(&serverPtr->monitorLock, "nsloopctl:monitor", server);
+        Ns_CondInit(&serverPtr->monitorCond);
+        serverPtr->monitorStop = NS_FALSE;
+        Ns_ThreadCreate(MonitorThread, serverPtr, 0, &serverPtr->monitorThread);
+        Ns_RegisterAtShutdown(StopMonitor, serverPtr);
+    }
+
+    /*
+     * Round the size of the event log up to a power of two.
+     */
+
+    n = Ns_ConfigIntRange(section, "eventlog", 1024, 0, LOOPCTL_EVENTS_MAX);
+    serverPtr->eventLogPtr = NULL;
+    serverPtr->eventLoops = Ns_ConfigBool(section, "eventloops", NS_FALSE);
+    if (n > 0) {
+        EventLog *logPtr = ns_malloc(sizeof(EventLog));
+        uint64_t  size = 1u;
+
+        while (size < (uint64_t)n) {
+            size <<= 1;
+        }
+        logPtr->head = 0u;
+        logPtr->mask = size - 1u;
+        logPtr->slots = ns_calloc((size_t)size, sizeof(Event));
+        serverPtr->eventLogPtr = logPtr;
+    }
+
+    Ns_TclRegisterTrace(server, InitInterp, serverPtr, NS_TCL_TRACE_CREATE);
     Ns_RegisterProcInfo((ns_funcptr_t)InitInterp, "nsloopctl:initinterp", NULL);
 
     return NS_OK;
 }
 
 static int
-InitInterp(Tcl_Interp *interp, const void *UNUSED(arg))
+InitInterp(Tcl_Interp *interp, const void *arg)
 {
+    ServerData  *serverPtr = (ServerData *)arg;
     ThreadData  *threadPtr;
-    char         tid[32];
-    int          new;
     size_t       i;
 
     static struct {
@@ -195,17 +864,23 @@ InitInterp(Tcl_Interp *interp, const void *UNUSED(arg))
     } ctlCmds[] = {
         {"loopctl_loops",   LoopsObjCmd},
         {"loopctl_info",    InfoObjCmd},
+        {"loopctl_stats",   StatsObjCmd},
+        {"loopctl_profile", ProfileObjCmd},
+        {"loopctl_histogram", HistogramObjCmd},
+        {"loopctl_metrics", MetricsObjCmd},
+        {"loopctl_events",  EventsObjCmd},
         {"loopctl_eval",    EvalObjCmd},
+        {"loopctl_wait",    WaitObjCmd},
+        {"loopctl_result",  ResultObjCmd},
         {"loopctl_pause",   PauseObjCmd},
         {"loopctl_run",     RunObjCmd},
         {"loopctl_cancel",  CancelObjCmd},
+        {"loopctl_throttle", ThrottleObjCmd},
+        {"loopctl_budget",  BudgetObjCmd},
+        {"loopctl_granularity", GranularityObjCmd},
 
         {"loopctl_threads", ThreadsObjCmd},
-        {"loopctl_abort",   AbortObjCmd},
-
-        {"for",             ForObjCmd},
-        {"while",           WhileObjCmd},
-        {"foreach",         ForeachObjCmd}
+        {"loopctl_abort",   AbortObjCmd}
     };
 
     /*
@@ -213,21 +888,107 @@ InitInterp(Tcl_Interp *interp, const void *UNUSED(arg))
      * been initialized for async signals.
      */
 
-    threadPtr = Ns_TlsGet(&tls);
-    if (threadPtr == NULL) {
-        threadPtr = ns_malloc(sizeof(ThreadData));
-        threadPtr->cancel = Tcl_AsyncCreate(ThreadAbort, NULL);
-        snprintf(tid, sizeof(tid), "%" PRIxPTR, Ns_ThreadId());
-        Ns_MutexLock(&lock);
-        threadPtr->hPtr = Tcl_CreateHashEntry(&threads, tid, &new);
-        Tcl_SetHashValue(threadPtr->hPtr, threadPtr);
-        Ns_MutexUnlock(&lock);
-        Ns_TlsSet(&tls, threadPtr);
-    }
+    threadPtr = GetThreadData();
+
+    /*
+     * Remember the builtin "incr" before any script had a chance to
+     * replace it.
+     */
 
+    if (incrProc == NULL) {
+        Tcl_CmdInfo info;
+
+        if (Tcl_GetCommandInfo(interp, "::incr", &info) != 0) {
+            Ns_MasterLock();
+            incrProc = info.objProc;
+            Ns_MasterUnlock();
+        }
+    }
 
     for (i = 0u; i < sizeof(ctlCmds) / sizeof(ctlCmds[0]); i++) {
-        TCL_CREATEOBJCOMMAND(interp, ctlCmds[i].name, ctlCmds[i].proc, NULL, NULL);
+        TCL_CREATEOBJCOMMAND(interp, ctlCmds[i].name, ctlCmds[i].proc, serverPtr, NULL);
+    }
+    for (i = 0u; i < sizeof(loopCmds) / sizeof(loopCmds[0]); i++) {
+        if ((serverPtr->loopCmds & (1u << i)) != 0u) {
+            TCL_CREATEOBJCOMMAND(interp, loopCmds[i].cmd, loopCmds[i].proc, serverPtr, NULL);
+        }
+    }
+
+    /*
+     * Let the limit engine check for control requests every
+     * "limitcommands" commands.
+     */
+
+    if (serverPtr->limitCommands > 0) {
+        Tcl_LimitAddHandler(interp, TCL_LIMIT_COMMANDS, LimitHandler, serverPtr, NULL);
+        Tcl_LimitSetCommands(interp, GetCmdCount(interp) + serverPtr->limitCommands);
+        Tcl_LimitTypeSet(interp, TCL_LIMIT_COMMANDS);
+        threadPtr->limited = NS_TRUE;
+    }
+
+    return NS_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * FreeInterp --
+ *
+ *      Re-arm the command limit of the limit engine, if it has been
+ *      saturated because the command counter of the interp is about
+ *      to wrap around.
+ *
+ * Results:
+ *      NS_OK.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+FreeInterp(Tcl_Interp *interp, const void *arg)
+{
+    const ServerData *serverPtr = arg;
+    Tcl_WideInt       limit;
+
+    if (Tcl_LimitGetCommands(interp) == TCL_SIZE_MAX) {
+        limit = (Tcl_WideInt)GetCmdCount(interp) + serverPtr->limitCommands;
+        if (limit < TCL_SIZE_MAX) {
+            Tcl_LimitSetCommands(interp, (TCL_SIZE_T)limit);
+        }
+    }
+
+    return NS_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DeleteInterp --
+ *
+ *      Release the loop bodies cached by the profile of the thread,
+ *      while the objects can still be freed.
+ *
+ * Results:
+ *      NS_OK.
+ *
+ * Side effects:
+ *      Cached sites of the loop bodies are forgotten.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+DeleteInterp(Tcl_Interp *UNUSED(interp), const void *UNUSED(arg))
+{
+    ThreadData *threadPtr = Ns_TlsGet(&tls);
+
+    if (threadPtr != NULL) {
+        FlushBodies(&threadPtr->bodies);
     }
 
     return NS_OK;
@@ -254,33 +1015,135 @@ InitInterp(Tcl_Interp *interp, const void *UNUSED(arg))
 static int
 LoopsObjCmd(ClientData clientData, Tcl_Interp *interp, TCL_SIZE_T objc, Tcl_Obj *const objv[])
 {
-    return List(clientData, interp, objc, objv, &loops);
+    return List(clientData, interp, objc, objv, offsetof(Shard, loops));
 }
 
 static int
 ThreadsObjCmd(ClientData clientData, Tcl_Interp *interp, TCL_SIZE_T objc, Tcl_Obj *const objv[])
 {
-    return List(clientData, interp, objc, objv, &threads);
+    int         stats = 0;
+    Ns_ObjvSpec opts[] = {
+        {"-stats", Ns_ObjvBool, &stats, INT2PTR(NS_TRUE)},
+        {NULL, NULL, NULL, NULL}
+    };
+
+    if (Ns_ParseObjv(opts, NULL, interp, 1, objc, objv) != NS_OK) {
+        return TCL_ERROR;
+    }
+    if (stats != 0) {
+        return ThreadStats(interp);
+    }
+    return List(clientData, interp, objc, objv, offsetof(Shard, threads));
 }
 
 static int
 List(ClientData UNUSED(clientData), Tcl_Interp *interp, TCL_SIZE_T UNUSED(objc), Tcl_Obj *const UNUSED(objv[]),
-     Tcl_HashTable *tablePtr)
+     size_t tableOffset)
 {
     Tcl_Obj        *listPtr, *objPtr;
     Tcl_HashSearch  search;
     Tcl_HashEntry  *hPtr;
+    unsigned int    i;
 
     listPtr = Tcl_NewListObj(0, NULL);
 
-    Ns_MutexLock(&lock);
-    hPtr = Tcl_FirstHashEntry(tablePtr, &search);
-    while (hPtr != NULL) {
-        objPtr = Tcl_NewStringObj(Tcl_GetHashKey(tablePtr, hPtr), -1);
-        Tcl_ListObjAppendElement(interp, listPtr, objPtr);
-        hPtr = Tcl_NextHashEntry(&search);
+    for (i = 0u; i < LOOPCTL_SHARDS; i++) {
+        Shard         *shardPtr = &shards[i];
+        Tcl_HashTable *tablePtr = (Tcl_HashTable *)((char *)shardPtr + tableOffset);
+
+        Ns_MutexLock(&shardPtr->lock);
+        hPtr = Tcl_FirstHashEntry(tablePtr, &search);
+        while (hPtr != NULL) {
+            if (tablePtr->keyType == TCL_ONE_WORD_KEYS) {
+                objPtr = NewIdObj((uintptr_t)Tcl_GetHashKey(tablePtr, hPtr));
+            } else {
+                objPtr = Tcl_NewStringObj(Tcl_GetHashKey(tablePtr, hPtr), -1);
+            }
+            Tcl_ListObjAppendElement(interp, listPtr, objPtr);
+            hPtr = Tcl_NextHashEntry(&search);
+        }
+        Ns_MutexUnlock(&shardPtr->lock);
+    }
+
+    Tcl_SetObjResult(interp, listPtr);
+
+    return TCL_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ThreadStats --
+ *
+ *      Implements loopctl_threads -stats: return the loop stack and
+ *      CPU time of all threads with interps as a list of dicts. The
+ *      CPU/wall ratio is computed since the module was first used in
+ *      the thread.
+ *
+ * Results:
+ *      A standard Tcl result.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+ThreadStats(Tcl_Interp *interp)
+{
+    Tcl_Obj          *listPtr, *dictPtr;
+    Tcl_HashSearch    search;
+    Tcl_HashEntry    *hPtr;
+    const ThreadData *threadPtr;
+    Ns_Time           now, cpu, diff;
+    unsigned int      i;
+
+    listPtr = Tcl_NewListObj(0, NULL);
+    Ns_GetTime(&now);
+
+    for (i = 0u; i < LOOPCTL_SHARDS; i++) {
+        Shard *shardPtr = &shards[i];
+
+        /*
+         * A thread removes itself from the table before it exits, so
+         * its clock is valid while the lock is held.
+         */
+
+        Ns_MutexLock(&shardPtr->lock);
+        hPtr = Tcl_FirstHashEntry(&shardPtr->threads, &search);
+        while (hPtr != NULL) {
+            threadPtr = Tcl_GetHashValue(hPtr);
+            GetCpuTime(threadPtr, &cpu);
+            (void) Ns_DiffTime(&cpu, &threadPtr->cpuStart, &diff);
+
+            dictPtr = Tcl_NewDictObj();
+            Tcl_DictObjPut(NULL, dictPtr, Tcl_NewStringObj("threadid", 8),
+                           Tcl_NewStringObj(Tcl_GetHashKey(&shardPtr->threads, hPtr), -1));
+            Tcl_DictObjPut(NULL, dictPtr, Tcl_NewStringObj("loopid", 6),
+                           threadPtr->loopPtr != NULL
+                           ? NewIdObj(threadPtr->loopPtr->lid) : Tcl_NewObj());
+            Tcl_DictObjPut(NULL, dictPtr, Tcl_NewStringObj("outerid", 7),
+                           threadPtr->outerPtr != NULL
+                           ? NewIdObj(threadPtr->outerPtr->lid) : Tcl_NewObj());
+            Tcl_DictObjPut(NULL, dictPtr, Tcl_NewStringObj("depth", 5),
+                           Tcl_NewIntObj(threadPtr->loopPtr != NULL
+                                         ? (int)threadPtr->loopPtr->depth : 0));
+            Tcl_DictObjPut(NULL, dictPtr, Tcl_NewStringObj("abortsent", 9),
+                           threadPtr->abortSent.sec != 0 || threadPtr->abortSent.usec != 0
+                           ? Ns_TclNewTimeObj(&threadPtr->abortSent) : Tcl_NewObj());
+            Tcl_DictObjPut(NULL, dictPtr, Tcl_NewStringObj("abortack", 8),
+                           threadPtr->abortAck.sec != 0 || threadPtr->abortAck.usec != 0
+                           ? Ns_TclNewTimeObj(&threadPtr->abortAck) : Tcl_NewObj());
+            Tcl_DictObjPut(NULL, dictPtr, Tcl_NewStringObj("cputime", 7), Ns_TclNewTimeObj(&cpu));
+            Tcl_DictObjPut(NULL, dictPtr, Tcl_NewStringObj("cpuratio", 8),
+                           Tcl_NewDoubleObj(CpuRatio(&diff, &threadPtr->start, &now)));
+            Tcl_ListObjAppendElement(NULL, listPtr, dictPtr);
+            hPtr = Tcl_NextHashEntry(&search);
+        }
+        Ns_MutexUnlock(&shardPtr->lock);
     }
-    Ns_MutexUnlock(&lock);
 
     Tcl_SetObjResult(interp, listPtr);
 
@@ -308,54 +1171,48 @@ static int
 InfoObjCmd(ClientData UNUSED(clientData), Tcl_Interp *interp, TCL_SIZE_T objc, Tcl_Obj *const objv[])
 {
     LoopData   *loopPtr;
-    const char *desc;
+    Shard      *shardPtr;
+    Tcl_DString ds;
+    Ns_Time     now;
 
     if (objc != 2) {
         Tcl_WrongNumArgs(interp, 1, objv, "loop-id");
         return TCL_ERROR;
     }
 
-    Ns_MutexLock(&lock);
-    if ((loopPtr = GetLoop(interp, objv[1])) == NULL) {
-        Ns_MutexUnlock(&lock);
+    if ((loopPtr = GetLoop(interp, objv[1], &shardPtr)) == NULL) {
         return TCL_ERROR;
     }
 
-    switch (loopPtr->control) {
-    case LOOP_RUN:
-        desc = "running";
-        break;
-    case LOOP_PAUSE:
-        desc = "paused";
-        break;
-    case LOOP_CANCEL:
-        desc = "canceled";
-        break;
-    default:
-        desc = "";
-        break;
-    }
+    Ns_GetTime(&now);
+    Tcl_DStringInit(&ds);
+    AppendRate(&ds, loopPtr, &now);
     Ns_TclPrintfResult(interp,
         "loopid %s threadid %" PRIxPTR
         " start %" PRIu64 ":%ld "
-        "spins %u status %s command {%s}",
+        "spins %" PRIu64 " status %s command {%s} %s"
+        " cputime " NS_TIME_FMT " cpuratio %.2f",
         Tcl_GetString(objv[1]), loopPtr->tid,
         (int64_t) loopPtr->etime.sec, loopPtr->etime.usec,
-        loopPtr->spins, desc, loopPtr->args.string);
+        LOOPCTL_LOAD64(&loopPtr->spins), GetStatus(loopPtr->control), loopPtr->args.string,
+        ds.string, (int64_t) loopPtr->cpu.sec, loopPtr->cpu.usec,
+        CpuRatio(&loopPtr->cpu, &loopPtr->wallStart, &now));
 
-    Ns_MutexUnlock(&lock);
+    Ns_MutexUnlock(&shardPtr->lock);
+    Tcl_DStringFree(&ds);
 
     return TCL_OK;
 }
 
-
+
 /*
  *----------------------------------------------------------------------
  *
- * EvalObjCmd --
+ * StatsObjCmd --
  *
- *      Implements loopctl_eval: evaluate the given script in the context
- *      of a running loop.
+ *      Implements loopctl_stats: return the state of all running
+ *      loops matching the filters as a list of dicts. Every shard is
+ *      locked once, instead of once per loop for loopctl_info.
  *
  * Results:
  *      A standard Tcl result.
@@ -367,152 +1224,227 @@ InfoObjCmd(ClientData UNUSED(clientData), Tcl_Interp *interp, TCL_SIZE_T objc, T
  */
 
 static int
-EvalObjCmd(ClientData UNUSED(clientData), Tcl_Interp *interp, TCL_SIZE_T objc, Tcl_Obj *const objv[])
+StatsObjCmd(ClientData UNUSED(clientData), Tcl_Interp *interp, TCL_SIZE_T objc, Tcl_Obj *const objv[])
 {
-    LoopData  *loopPtr;
-    EvalData   eval;
-    char      *script;
-    Ns_Time    timeout;
-    int        result, status;
-    TCL_SIZE_T len;
+    enum {
+        KLoopid, KThreadid, KStart, KSpins, KStatus, KElapsed, KCputime, KCpuratio,
+        KCommand, KMax
+    };
+    static const char *const keyNames[] = {
+        "loopid", "threadid", "start", "spins", "status", "elapsed", "cputime", "cpuratio",
+        "command"
+    };
+    Tcl_Obj          *keys[KMax], *listPtr, *dictPtr;
+    Tcl_HashSearch    search;
+    Tcl_HashEntry    *hPtr;
+    const LoopData   *loopPtr;
+    char              buf[TCL_INTEGER_SPACE * 2];
+    Ns_Time           elapsed;
+    Selector          sel = {NULL, 0, NULL, 0, NULL, {0, 0}, 0u, 0u};
+    int               limit = 0, count = 0, i;
+    unsigned int      n;
+    Ns_ObjvValueRange range = {0, INT_MAX};
+    Ns_ObjvSpec opts[] = {
+        {"-thread",     Ns_ObjvString, &sel.thread,        NULL},
+        {"-minelapsed", Ns_ObjvTime,   &sel.minElapsedPtr, NULL},
+        {"-minspins",   Ns_ObjvInt,    &sel.minSpins,      &range},
+        {"-match",      Ns_ObjvString, &sel.pattern,       NULL},
+        {"-limit",      Ns_ObjvInt,    &limit,             &range},
+        {NULL, NULL, NULL, NULL}
+    };
 
-    if (objc != 3) {
-        Tcl_WrongNumArgs(interp, 1, objv, "loop-id script");
+    if (Ns_ParseObjv(opts, NULL, interp, 1, objc, objv) != NS_OK
+        || InitSelector(interp, &sel) != TCL_OK) {
         return TCL_ERROR;
     }
 
-    result = TCL_ERROR;
-
-    Ns_MutexLock(&lock);
-    if ((loopPtr = GetLoop(interp, objv[1])) == NULL) {
-        goto done;
-    }
-
-    if (loopPtr->evalPtr != NULL) {
-        Tcl_SetObjResult(interp, Tcl_NewStringObj("eval pending", -1));
-        goto done;
+    for (i = 0; i < KMax; i++) {
+        keys[i] = Tcl_NewStringObj(keyNames[i], -1);
+        Tcl_IncrRefCount(keys[i]);
     }
+    listPtr = Tcl_NewListObj(0, NULL);
 
-    /*
-     * Queue new script to eval.
-     */
-
-    eval.state = EVAL_WAIT;
-    eval.code = TCL_OK;
-    Tcl_DStringInit(&eval.result);
-    Tcl_DStringInit(&eval.script);
-    script = Tcl_GetStringFromObj(objv[2], &len);
-    Tcl_DStringAppend(&eval.script, script, len);
-    loopPtr->evalPtr = &eval;
+    for (n = sel.first; n <= sel.last && (limit == 0 || count < limit); n++) {
+        Shard *shardPtr = &shards[n];
 
-    /*
-     * Wait for result.
-     */
+        Ns_MutexLock(&shardPtr->lock);
+        hPtr = Tcl_FirstHashEntry(&shardPtr->loops, &search);
+        while (hPtr != NULL && (limit == 0 || count < limit)) {
+            loopPtr = Tcl_GetHashValue(hPtr);
+            hPtr = Tcl_NextHashEntry(&search);
 
-    Ns_GetTime(&timeout);
-    Ns_IncrTime(&timeout, 2, 0);
-    Ns_CondBroadcast(&cond);
+            if (!MatchLoop(loopPtr, &sel, &elapsed)) {
+                continue;
+            }
 
-    status = NS_OK;
-    while (status == NS_OK && eval.state == EVAL_WAIT) {
-        status = Ns_CondTimedWait(&cond, &lock, &timeout);
+            dictPtr = Tcl_NewDictObj();
+            Tcl_DictObjPut(NULL, dictPtr, keys[KLoopid], NewIdObj(loopPtr->lid));
+            snprintf(buf, sizeof(buf), "%" PRIxPTR, loopPtr->tid);
+            Tcl_DictObjPut(NULL, dictPtr, keys[KThreadid], Tcl_NewStringObj(buf, -1));
+            snprintf(buf, sizeof(buf), "%" PRIu64 ":%ld",
+                     (int64_t) loopPtr->etime.sec, loopPtr->etime.usec);
+            Tcl_DictObjPut(NULL, dictPtr, keys[KStart], Tcl_NewStringObj(buf, -1));
+            Tcl_DictObjPut(NULL, dictPtr, keys[KSpins], Tcl_NewWideIntObj((Tcl_WideInt)LOOPCTL_LOAD64(&loopPtr->spins)));
+            Tcl_DictObjPut(NULL, dictPtr, keys[KStatus],
+                           Tcl_NewStringObj(GetStatus(loopPtr->control), -1));
+            Tcl_DictObjPut(NULL, dictPtr, keys[KElapsed], Ns_TclNewTimeObj(&elapsed));
+            Tcl_DictObjPut(NULL, dictPtr, keys[KCputime], Ns_TclNewTimeObj(&loopPtr->cpu));
+            Tcl_DictObjPut(NULL, dictPtr, keys[KCpuratio],
+                           Tcl_NewDoubleObj(CpuRatio(&loopPtr->cpu, &loopPtr->wallStart,
+                                                     &sel.now)));
+            Tcl_DictObjPut(NULL, dictPtr, keys[KCommand],
+                           Tcl_NewStringObj(loopPtr->args.string, loopPtr->args.length));
+            Tcl_ListObjAppendElement(NULL, listPtr, dictPtr);
+            count++;
+        }
+        Ns_MutexUnlock(&shardPtr->lock);
     }
 
-    switch (eval.state) {
-    case EVAL_WAIT:
-        Tcl_SetObjResult(interp, Tcl_NewStringObj("timeout: result dropped", -1));
-        loopPtr->evalPtr = NULL;
-        break;
-
-    case EVAL_DROP:
-        Tcl_SetObjResult(interp, Tcl_NewStringObj("dropped: loop exited", -1));
-        break;
-
-    case EVAL_DONE:
-        Tcl_DStringResult(interp, &eval.result);
-        result = eval.code;
+    for (i = 0; i < KMax; i++) {
+        Tcl_DecrRefCount(keys[i]);
     }
-    Tcl_DStringFree(&eval.script);
-    Tcl_DStringFree(&eval.result);
-
- done:
-    Ns_MutexUnlock(&lock);
+    Tcl_SetObjResult(interp, listPtr);
 
-    return result;
+    return TCL_OK;
 }
 
 
 /*
  *----------------------------------------------------------------------
  *
- * PauseObjCmd, RunObjCmd, CancelObjCmd --
+ * ProfileObjCmd --
  *
- *      Implements loopctl_pause, loopctl_run and loopctl_cancel: send
- *      control signal to a loop.
+ *      Implements loopctl_profile: return the statistics of the loop
+ *      call sites with the highest total run time, spins, count or
+ *      max run time as a list of dicts. The per-thread profiles are
+ *      merged on every call.
  *
  * Results:
  *      A standard Tcl result.
  *
  * Side effects:
- *      None.
+ *      The profiles are cleared when -reset is given.
  *
  *----------------------------------------------------------------------
  */
 
 static int
-PauseObjCmd(ClientData clientData, Tcl_Interp *interp, TCL_SIZE_T objc, Tcl_Obj *const objv[])
+ProfileObjCmd(ClientData UNUSED(clientData), Tcl_Interp *interp, TCL_SIZE_T objc, Tcl_Obj *const objv[])
 {
-    return Signal(clientData, interp, objc, objv, LOOP_PAUSE);
-}
+    static Ns_ObjvTable sortKeys[] = {
+        {"time",  0u},
+        {"spins", 1u},
+        {"count", 2u},
+        {"max",   3u},
+        {NULL,    0u}
+    };
+    Tcl_HashTable     merged;
+    Tcl_HashSearch    search;
+    Tcl_HashEntry    *hPtr;
+    SiteRank         *ranks;
+    Tcl_Obj          *listPtr, *dictPtr, *histPtr;
+    Ns_Time           t;
+    int               limit = 0, reset = 0, sortBy = 0;
+    unsigned int      i, b;
+    TCL_SIZE_T        n = 0, k;
+    Ns_ObjvValueRange range = {0, INT_MAX};
+    Ns_ObjvSpec opts[] = {
+        {"-limit",  Ns_ObjvInt,   &limit,  &range},
+        {"-sortby", Ns_ObjvIndex, &sortBy, sortKeys},
+        {"-reset",  Ns_ObjvBool,  &reset,  INT2PTR(NS_TRUE)},
+        {NULL, NULL, NULL, NULL}
+    };
 
-static int
-RunObjCmd(ClientData clientData, Tcl_Interp *interp, TCL_SIZE_T objc, Tcl_Obj *const objv[])
-{
-    return Signal(clientData, interp, objc, objv, LOOP_RUN);
-}
+    if (Ns_ParseObjv(opts, NULL, interp, 1, objc, objv) != NS_OK) {
+        return TCL_ERROR;
+    }
 
-static int
-CancelObjCmd(ClientData clientData, Tcl_Interp *interp, TCL_SIZE_T objc, Tcl_Obj *const objv[])
-{
-    return Signal(clientData, interp, objc, objv, LOOP_CANCEL);
-}
+    Tcl_InitHashTable(&merged, (int)LOOPCTL_SITE_KEY);
+    for (i = 0u; i < LOOPCTL_SHARDS; i++) {
+        Shard *shardPtr = &shards[i];
 
-static int
-Signal(ClientData UNUSED(clientData), Tcl_Interp *interp, TCL_SIZE_T objc, Tcl_Obj *const objv[],
-       LoopControl signal)
-{
-    LoopData *loopPtr;
+        Ns_MutexLock(&shardPtr->lock);
+        MergeSites(&merged, &shardPtr->sites, NULL);
+        if (reset) {
+            FreeSites(&shardPtr->sites);
+            Tcl_InitHashTable(&shardPtr->sites, (int)LOOPCTL_SITE_KEY);
+        }
+        hPtr = Tcl_FirstHashEntry(&shardPtr->threads, &search);
+        while (hPtr != NULL) {
+            ThreadData *threadPtr = Tcl_GetHashValue(hPtr);
 
-    if (objc != 2) {
-        Tcl_WrongNumArgs(interp, 1, objv, "loop-id");
-        return TCL_ERROR;
+            MergeSites(&merged, &threadPtr->sites, &threadPtr->profileEpoch);
+            if (reset) {
+                LOOPCTL_STORE(&threadPtr->profileEpoch, threadPtr->profileEpoch + 1u);
+            }
+            hPtr = Tcl_NextHashEntry(&search);
+        }
+        Ns_MutexUnlock(&shardPtr->lock);
     }
 
-    Ns_MutexLock(&lock);
-    if ((loopPtr = GetLoop(interp, objv[1])) == NULL) {
-        Ns_MutexUnlock(&lock);
-        return TCL_ERROR;
+    ranks = ns_malloc(sizeof(SiteRank) * ((size_t)merged.numEntries + 1u));
+    hPtr = Tcl_FirstHashEntry(&merged, &search);
+    while (hPtr != NULL) {
+        const Site *sitePtr = Tcl_GetHashValue(hPtr);
+
+        ranks[n].sitePtr = sitePtr;
+        ranks[n].key = (sortBy == 0) ? sitePtr->usec
+            : (sortBy == 1) ? sitePtr->spins
+            : (sortBy == 2) ? sitePtr->count
+            : sitePtr->maxUsec;
+        n++;
+        hPtr = Tcl_NextHashEntry(&search);
+    }
+    qsort(ranks, (size_t)n, sizeof(SiteRank), CompareRank);
+    if (limit > 0 && n > limit) {
+        n = limit;
     }
 
-    loopPtr->control = signal;
-    Ns_CondBroadcast(&cond);
-
-    Ns_MutexUnlock(&lock);
+    listPtr = Tcl_NewListObj(0, NULL);
+    for (k = 0; k < n; k++) {
+        const Site *sitePtr = ranks[k].sitePtr;
+
+        dictPtr = Tcl_NewDictObj();
+        Tcl_DictObjPut(NULL, dictPtr, Tcl_NewStringObj("command", 7),
+                       Tcl_NewStringObj(sitePtr->label, -1));
+        Tcl_DictObjPut(NULL, dictPtr, Tcl_NewStringObj("count", 5),
+                       Tcl_NewWideIntObj((Tcl_WideInt)sitePtr->count));
+        Tcl_DictObjPut(NULL, dictPtr, Tcl_NewStringObj("spins", 5),
+                       Tcl_NewWideIntObj((Tcl_WideInt)sitePtr->spins));
+        t.sec = (time_t)(sitePtr->usec / 1000000u);
+        t.usec = (long)(sitePtr->usec % 1000000u);
+        Tcl_DictObjPut(NULL, dictPtr, Tcl_NewStringObj("time", 4), Ns_TclNewTimeObj(&t));
+        t.sec = (time_t)(sitePtr->maxUsec / 1000000u);
+        t.usec = (long)(sitePtr->maxUsec % 1000000u);
+        Tcl_DictObjPut(NULL, dictPtr, Tcl_NewStringObj("maxtime", 7), Ns_TclNewTimeObj(&t));
+        histPtr = Tcl_NewListObj(0, NULL);
+        for (b = 0u; b < LOOPCTL_BUCKETS; b++) {
+            if (sitePtr->hist[b] > 0u) {
+                Tcl_ListObjAppendElement(NULL, histPtr, Tcl_NewWideIntObj((Tcl_WideInt)1 << b));
+                Tcl_ListObjAppendElement(NULL, histPtr,
+                                         Tcl_NewWideIntObj((Tcl_WideInt)sitePtr->hist[b]));
+            }
+        }
+        Tcl_DictObjPut(NULL, dictPtr, Tcl_NewStringObj("histogram", 9), histPtr);
+        Tcl_ListObjAppendElement(NULL, listPtr, dictPtr);
+    }
+    ns_free(ranks);
+    FreeSites(&merged);
+    Tcl_SetObjResult(interp, listPtr);
 
     return TCL_OK;
 }
 
-
+
 /*
  *----------------------------------------------------------------------
  *
- * AbortObjCmd --
+ * CompareRank --
  *
- *      Implements loopctl_abort: abort a running thread using Tcl
- *      async signals.
+ *      qsort callback ordering call sites by descending sort key.
  *
  * Results:
- *      A standard Tcl result.
+ *      Negative, zero or positive.
  *
  * Side effects:
  *      None.
@@ -521,591 +1453,4409 @@ Signal(ClientData UNUSED(clientData), Tcl_Interp *interp, TCL_SIZE_T objc, Tcl_O
  */
 
 static int
-AbortObjCmd(ClientData UNUSED(clientData), Tcl_Interp *interp, TCL_SIZE_T objc, Tcl_Obj *const objv[])
+CompareRank(const void *a, const void *b)
 {
-    char           *id;
-    Tcl_HashEntry  *hPtr;
-    ThreadData     *threadPtr;
-    int             result;
-
-    if (objc != 2) {
-        Tcl_WrongNumArgs(interp, 1, objv, "thread-id");
-        return TCL_ERROR;
-    }
-    id = Tcl_GetString(objv[1]);
-
-    Ns_MutexLock(&lock);
-    hPtr = Tcl_FindHashEntry(&threads, id);
-    if (hPtr != NULL) {
-        threadPtr = Tcl_GetHashValue(hPtr);
-        Tcl_AsyncMark(threadPtr->cancel);
-        result = TCL_OK;
-    } else {
-        Tcl_AppendResult(interp, "no such active thread: ", id, NULL);
-        result = TCL_ERROR;
-    }
-    Ns_MutexUnlock(&lock);
+    uint64_t ka = ((const SiteRank *)a)->key, kb = ((const SiteRank *)b)->key;
 
-    return result;
+    return (ka < kb) - (ka > kb);
 }
 
-
+
 /*
  *----------------------------------------------------------------------
  *
- * ForObjCmd --
- *
- *      This procedure is invoked to process the "for" Tcl command.
- *      See the user documentation for details on what it does.
- *
- *      With the bytecode compiler, this procedure is only called when
- *      a command name is computed at runtime, and is "for" or the name
- *      to which "for" was renamed: e.g.,
- *      "set z for; $z {set i 0} {$i<100} {incr i} {puts $i}"
+ * HistogramObj --
  *
- *      Copied from the Tcl source with additional calls to the
- *      loop control facility.
+ *      Build the dict of a histogram for loopctl_histogram, with the
+ *      count, percentiles estimated from the upper bounds of the
+ *      buckets, and the non-empty buckets.
  *
  * Results:
- *      A standard Tcl result.
+ *      A new dict object.
  *
  * Side effects:
- *      See the user documentation.
+ *      None.
  *
  *----------------------------------------------------------------------
  */
 
-static int
-ForObjCmd(ClientData UNUSED(arg),  Tcl_Interp *interp, TCL_SIZE_T objc, Tcl_Obj *const objv[])
+static Tcl_Obj *
+HistogramObj(const uint64_t *buckets)
 {
-    LoopData  data;
-    int       result, value;
+    static const struct {
+        const char *name;
+        double      quantile;
+    } percentiles[] = {
+        {"p50", 0.5}, {"p90", 0.9}, {"p99", 0.99}, {"p999", 0.999}
+    };
+    Tcl_Obj     *dictPtr, *listPtr;
+    uint64_t     count = 0u, sum;
+    unsigned int b, i;
 
-    if (objc != 5) {
-        Tcl_WrongNumArgs(interp, 1, objv, "start test next command");
-        return TCL_ERROR;
+    listPtr = Tcl_NewListObj(0, NULL);
+    for (b = 0u; b < LOOPCTL_BUCKETS; b++) {
+        if (buckets[b] > 0u) {
+            count += buckets[b];
+            Tcl_ListObjAppendElement(NULL, listPtr, Tcl_NewWideIntObj((Tcl_WideInt)1 << b));
+            Tcl_ListObjAppendElement(NULL, listPtr, Tcl_NewWideIntObj((Tcl_WideInt)buckets[b]));
+        }
     }
+    dictPtr = Tcl_NewDictObj();
+    Tcl_DictObjPut(NULL, dictPtr, Tcl_NewStringObj("count", 5), Tcl_NewWideIntObj((Tcl_WideInt)count));
+    for (i = 0u; i < sizeof(percentiles) / sizeof(percentiles[0]); i++) {
+        uint64_t rank = (uint64_t)((double)count * percentiles[i].quantile + 0.5);
 
-    result = Tcl_EvalObjEx(interp, objv[1], 0);
-    if (result != TCL_OK) {
-        if (result == TCL_ERROR) {
-            Tcl_AddErrorInfo(interp, "\n    (\"for\" initial command)");
+        if (rank == 0u) {
+            rank = 1u;
         }
-        return result;
+        sum = 0u;
+        for (b = 0u; b < LOOPCTL_BUCKETS - 1u; b++) {
+            sum += buckets[b];
+            if (sum >= rank) {
+                break;
+            }
+        }
+        Tcl_DictObjPut(NULL, dictPtr, Tcl_NewStringObj(percentiles[i].name, -1),
+                       Tcl_NewWideIntObj(count > 0u ? (Tcl_WideInt)1 << b : 0));
     }
+    Tcl_DictObjPut(NULL, dictPtr, Tcl_NewStringObj("buckets", 7), listPtr);
 
-    EnterLoop(&data, objc, objv);
+    return dictPtr;
+}
 
-    while (1) {
-        /*
-         * We need to reset the result before passing it off to
-         * Tcl_ExprBooleanObj.  Otherwise, any error message will be appended
-         * to the result of the last evaluation.
-         */
 
-        Tcl_ResetResult(interp);
-        result = Tcl_ExprBooleanObj(interp, objv[2], &value);
-        if (result != TCL_OK) {
-            goto done;
-        }
-        if (!value) {
-            break;
-        }
-        result = CheckControl(interp, &data);
-        if (result == TCL_OK) {
-            result = Tcl_EvalObjEx(interp, objv[4], 0);
-        }
-        if ((result != TCL_OK) && (result != TCL_CONTINUE)) {
-            if (result == TCL_ERROR) {
-                char msg[32 + TCL_INTEGER_SPACE];
+/*
+ *----------------------------------------------------------------------
+ *
+ * HistogramObjCmd --
+ *
+ *      Implements loopctl_histogram: return the distribution of the
+ *      run time and of the time per spin of the loops of this virtual
+ *      server, summed over all threads.
+ *
+ * Results:
+ *      A standard Tcl result.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
 
-                sprintf(msg, "\n    (\"for\" body line %d)",Tcl_GetErrorLine(interp));
-                Tcl_AddErrorInfo(interp, msg);
+static int
+HistogramObjCmd(ClientData clientData, Tcl_Interp *interp, TCL_SIZE_T objc, Tcl_Obj *const objv[])
+{
+    const ServerData *serverPtr = clientData;
+    const Histogram  *histPtr;
+    Tcl_HashSearch    search;
+    Tcl_HashEntry    *hPtr;
+    Tcl_Obj          *dictPtr;
+    uint64_t          duration[LOOPCTL_BUCKETS], itertime[LOOPCTL_BUCKETS];
+    unsigned int      i, b;
+
+    if (objc != 1) {
+        Tcl_WrongNumArgs(interp, 1, objv, NULL);
+        return TCL_ERROR;
+    }
+
+    memset(duration, 0, sizeof(duration));
+    memset(itertime, 0, sizeof(itertime));
+    for (i = 0u; i < LOOPCTL_SHARDS; i++) {
+        Shard *shardPtr = &shards[i];
+
+        Ns_MutexLock(&shardPtr->lock);
+        for (histPtr = shardPtr->histPtr; histPtr != NULL; histPtr = histPtr->nextPtr) {
+            if (histPtr->serverPtr == serverPtr) {
+                for (b = 0u; b < LOOPCTL_BUCKETS; b++) {
+                    duration[b] += histPtr->duration[b];
+                    itertime[b] += histPtr->itertime[b];
+                }
             }
-            break;
         }
-
-        result = Tcl_EvalObjEx(interp, objv[3], 0);
-
-        if (result == TCL_BREAK) {
-            break;
-        } else if (result != TCL_OK) {
-            if (result == TCL_ERROR) {
-                Tcl_AddErrorInfo(interp, "\n    (\"for\" loop-end command)");
+        hPtr = Tcl_FirstHashEntry(&shardPtr->threads, &search);
+        while (hPtr != NULL) {
+            const ThreadData *threadPtr = Tcl_GetHashValue(hPtr);
+
+            for (histPtr = threadPtr->histPtr; histPtr != NULL; histPtr = histPtr->nextPtr) {
+                if (histPtr->serverPtr == serverPtr) {
+                    for (b = 0u; b < LOOPCTL_BUCKETS; b++) {
+                        duration[b] += LOOPCTL_LOAD64(&histPtr->duration[b]);
+                        itertime[b] += LOOPCTL_LOAD64(&histPtr->itertime[b]);
+                    }
+                }
             }
-            goto done;
+            hPtr = Tcl_NextHashEntry(&search);
         }
+        Ns_MutexUnlock(&shardPtr->lock);
     }
-    if (result == TCL_BREAK) {
-        result = TCL_OK;
-    }
-    if (result == TCL_OK) {
-        Tcl_ResetResult(interp);
-    }
- done:
-    LeaveLoop(&data);
 
-    return result;
+    dictPtr = Tcl_NewDictObj();
+    Tcl_DictObjPut(NULL, dictPtr, Tcl_NewStringObj("duration", 8), HistogramObj(duration));
+    Tcl_DictObjPut(NULL, dictPtr, Tcl_NewStringObj("itertime", 8), HistogramObj(itertime));
+    Tcl_SetObjResult(interp, dictPtr);
+
+    return TCL_OK;
 }
 
-
+
 /*
  *----------------------------------------------------------------------
  *
- * WhileObjCmd --
- *
- *      This procedure is invoked to process the "while" Tcl command.
- *      See the user documentation for details on what it does.
- *
- *      With the bytecode compiler, this procedure is only called when
- *      a command name is computed at runtime, and is "while" or the name
- *      to which "while" was renamed: e.g., "set z while; $z {$i<100} {}"
+ * MetricsObjCmd --
  *
- *      Copied from the Tcl source with additional calls to the
- *      loop control facility.
+ *      Implements loopctl_metrics: return the module-wide event
+ *      counters as a dict, or in the Prometheus text format.
  *
  * Results:
  *      A standard Tcl result.
  *
  * Side effects:
- *      See the user documentation.
+ *      None.
  *
  *----------------------------------------------------------------------
  */
 
 static int
-WhileObjCmd(ClientData UNUSED(clientData), Tcl_Interp *interp, TCL_SIZE_T objc, Tcl_Obj *const objv[])
+MetricsObjCmd(ClientData UNUSED(clientData), Tcl_Interp *interp, TCL_SIZE_T objc, Tcl_Obj *const objv[])
 {
-    LoopData  data;
-    int       result, value;
+    static Ns_ObjvTable formats[] = {
+        {"dict",       0u},
+        {"prometheus", 1u},
+        {NULL,         0u}
+    };
+    uint64_t     counts[COUNT_MAX];
+    int          format = 0;
+    unsigned int i, c;
+    Ns_ObjvSpec  opts[] = {
+        {"-format", Ns_ObjvIndex, &format, formats},
+        {NULL, NULL, NULL, NULL}
+    };
 
-    if (objc != 3) {
-        Tcl_WrongNumArgs(interp, 1, objv, "test command");
+    if (Ns_ParseObjv(opts, NULL, interp, 1, objc, objv) != NS_OK) {
         return TCL_ERROR;
     }
 
-    EnterLoop(&data, objc, objv);
-
-    while (1) {
-        result = Tcl_ExprBooleanObj(interp, objv[1], &value);
-        if (result != TCL_OK) {
-            goto done;
-        }
-        if (!value) {
-            break;
+    memset(counts, 0, sizeof(counts));
+    for (i = 0u; i < LOOPCTL_SHARDS; i++) {
+        for (c = 0u; c < COUNT_MAX; c++) {
+            counts[c] += LOOPCTL_LOAD64(&shards[i].counts[c]);
         }
-        result = CheckControl(interp, &data);
-        if (result == TCL_OK) {
-            result = Tcl_EvalObjEx(interp, objv[2], 0);
+    }
+
+    if (format == 0) {
+        Tcl_Obj *dictPtr = Tcl_NewDictObj();
+
+        for (c = 0u; c < COUNT_MAX; c++) {
+            Tcl_DictObjPut(NULL, dictPtr, Tcl_NewStringObj(counterNames[c], -1),
+                           Tcl_NewWideIntObj((Tcl_WideInt)counts[c]));
         }
-        if ((result != TCL_OK) && (result != TCL_CONTINUE)) {
-            if (result == TCL_ERROR) {
-                char msg[32 + TCL_INTEGER_SPACE];
+        Tcl_SetObjResult(interp, dictPtr);
+    } else {
+        Tcl_DString ds;
 
-                sprintf(msg, "\n    (\"while\" body line %d)",
-                        Tcl_GetErrorLine(interp));
-                Tcl_AddErrorInfo(interp, msg);
-            }
-            break;
+        Tcl_DStringInit(&ds);
+        for (c = 0u; c < COUNT_MAX; c++) {
+            Ns_DStringPrintf(&ds, "# TYPE nsloopctl_%s_total counter\n"
+                             "nsloopctl_%s_total %" PRIu64 "\n",
+                             counterNames[c], counterNames[c], counts[c]);
         }
+        Tcl_DStringResult(interp, &ds);
     }
-    if (result == TCL_BREAK) {
-        result = TCL_OK;
-    }
-    if (result == TCL_OK) {
-        Tcl_ResetResult(interp);
-    }
- done:
-    LeaveLoop(&data);
 
-    return result;
+    return TCL_OK;
 }
 
-
+
 /*
  *----------------------------------------------------------------------
  *
- * ForeachObjCmd --
+ * EventsObjCmd --
  *
- *      This object-based procedure is invoked to process the "foreach" Tcl
- *      command.  See the user documentation for details on what it does.
+ *      Implements loopctl_events: return the logged loop lifecycle
+ *      events as a list of dicts, oldest first. With -since, only the
+ *      events with a higher sequence number are returned, such that
+ *      the log can be read incrementally. Events overwritten before
+ *      they were read leave a gap in the sequence numbers.
  *
  * Results:
- *      A standard Tcl object result.
+ *      A standard Tcl result.
  *
  * Side effects:
- *      See the user documentation.
+ *      None.
  *
  *----------------------------------------------------------------------
  */
 
 static int
-ForeachObjCmd(ClientData UNUSED(clientData), Tcl_Interp *interp, TCL_SIZE_T objc, Tcl_Obj *const objv[])
+EventsObjCmd(ClientData clientData, Tcl_Interp *interp, TCL_SIZE_T objc, Tcl_Obj *const objv[])
 {
-    LoopData  data;
-    int       result = TCL_OK;
-    TCL_SIZE_T       i;              /* i selects a value list */
-    int       j, maxj;        /* Number of loop iterations */
-    int       v;              /* v selects a loop variable */
-    int       numLists;       /* Count of value lists */
-    Tcl_Obj  *bodyPtr;
+    enum {
+        KSeq, KTime, KEvent, KLoopid, KThreadid, KSpins, KCommand, KMax
+    };
+    static const char *const keyNames[] = {
+        "seq", "time", "event", "loopid", "threadid", "spins", "command"
+    };
+    const ServerData *serverPtr = clientData;
+    const EventLog   *logPtr = serverPtr->eventLogPtr;
+    Tcl_Obj          *keys[KMax], *listPtr, *dictPtr;
+    Event             event;
+    const Event      *slotPtr;
+    char              buf[TCL_INTEGER_SPACE * 2];
+    uint64_t          head, seq;
+    Tcl_WideInt       since = 0;
+    int               i;
+    Ns_ObjvValueRange range = {0, LLONG_MAX};
+    Ns_ObjvSpec opts[] = {
+        {"-since", Ns_ObjvWideInt, &since, &range},
+        {NULL, NULL, NULL, NULL}
+    };
 
-    /*
-     * We copy the argument object pointers into a local array to avoid
-     * the problem that "objv" might become invalid. It is a pointer into
-     * the evaluation stack and that stack might be grown and reallocated
-     * if the loop body requires a large amount of stack space.
-     */
+    if (Ns_ParseObjv(opts, NULL, interp, 1, objc, objv) != NS_OK) {
+        return TCL_ERROR;
+    }
 
-#define NUM_ARGS 9
-    Tcl_Obj *(argObjStorage[NUM_ARGS]);
-    Tcl_Obj **argObjv = argObjStorage;
+    listPtr = Tcl_NewListObj(0, NULL);
+    if (logPtr == NULL) {
+        Tcl_SetObjResult(interp, listPtr);
+        return TCL_OK;
+    }
 
-#define STATIC_LIST_SIZE 4
-    TCL_SIZE_T indexArray[STATIC_LIST_SIZE];
-    TCL_SIZE_T varcListArray[STATIC_LIST_SIZE];
-    Tcl_Obj  **varvListArray[STATIC_LIST_SIZE];
-    TCL_SIZE_T argcListArray[STATIC_LIST_SIZE];
-    Tcl_Obj  **argvListArray[STATIC_LIST_SIZE];
+    for (i = 0; i < KMax; i++) {
+        keys[i] = Tcl_NewStringObj(keyNames[i], -1);
+        Tcl_IncrRefCount(keys[i]);
+    }
 
-    TCL_SIZE_T *index = indexArray;          /* Array of value list indices */
-    TCL_SIZE_T *varcList = varcListArray;   /* # loop variables per list */
-    Tcl_Obj  ***varvList = varvListArray;   /* Array of var name lists */
-    TCL_SIZE_T *argcList = argcListArray;   /* Array of value list sizes */
-    Tcl_Obj   ***argvList = argvListArray;   /* Array of value lists */
+    /*
+     * Nothing is returned when -since is not older than the head,
+     * otherwise at most the slots of the ring.
+     */
 
-    if (objc < 4 || (objc%2 != 0)) {
-        Tcl_WrongNumArgs(interp, 1, objv,
-                         "varList list ?varList list ...? command");
+    head = LOOPCTL_LOAD64(&logPtr->head);
+    seq = (uint64_t)since;
+    if (seq > head) {
+        seq = head;
+    } else if (head - seq > logPtr->mask + 1u) {
+        seq = head - logPtr->mask - 1u;
+    }
+    while (++seq <= head) {
+        slotPtr = &logPtr->slots[(seq - 1u) & logPtr->mask];
+
+        /*
+         * Skip slots which are still being written or which were
+         * overwritten while copied.
+         */
+
+        if (LOOPCTL_ACQUIRE64(&slotPtr->seq) != seq) {
+            continue;
+        }
+        memcpy(&event, slotPtr, sizeof(event));
+        LOOPCTL_FENCE_ACQUIRE();
+        if (LOOPCTL_LOAD64(&slotPtr->seq) != seq) {
+            continue;
+        }
+        event.command[LOOPCTL_EVENT_CMD - 1u] = '\0';
+
+        dictPtr = Tcl_NewDictObj();
+        Tcl_DictObjPut(NULL, dictPtr, keys[KSeq], Tcl_NewWideIntObj((Tcl_WideInt)seq));
+        Tcl_DictObjPut(NULL, dictPtr, keys[KTime], Ns_TclNewTimeObj(&event.time));
+        Tcl_DictObjPut(NULL, dictPtr, keys[KEvent], Tcl_NewStringObj(eventNames[event.type], -1));
+        Tcl_DictObjPut(NULL, dictPtr, keys[KLoopid], NewIdObj(event.lid));
+        snprintf(buf, sizeof(buf), "%" PRIxPTR, event.tid);
+        Tcl_DictObjPut(NULL, dictPtr, keys[KThreadid], Tcl_NewStringObj(buf, -1));
+        Tcl_DictObjPut(NULL, dictPtr, keys[KSpins], Tcl_NewWideIntObj((Tcl_WideInt)event.spins));
+        Tcl_DictObjPut(NULL, dictPtr, keys[KCommand], Tcl_NewStringObj(event.command, -1));
+        Tcl_ListObjAppendElement(NULL, listPtr, dictPtr);
+    }
+
+    for (i = 0; i < KMax; i++) {
+        Tcl_DecrRefCount(keys[i]);
+    }
+    Tcl_SetObjResult(interp, listPtr);
+
+    return TCL_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * BudgetObjCmd --
+ *
+ *      Implements loopctl_budget: query or change the spin and time
+ *      budget of a running loop. A value of 0 removes the limit.
+ *
+ * Results:
+ *      A standard Tcl result.
+ *
+ * Side effects:
+ *      The loop applies the new budget at the top of the next spin.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+BudgetObjCmd(ClientData UNUSED(clientData), Tcl_Interp *interp, TCL_SIZE_T objc, Tcl_Obj *const objv[])
+{
+    LoopData          *loopPtr;
+    Shard             *shardPtr;
+    const Budget      *budgetPtr;
+    Tcl_Obj           *idObj = NULL;
+    Ns_Time           *timePtr = NULL;
+    int                spins = -1;
+    Ns_ObjvValueRange  spinsRange = {0, INT_MAX};
+    Ns_ObjvTimeRange   timeRange = {{0, 0}, {LONG_MAX, 0}};
+    Ns_ObjvSpec opts[] = {
+        {"-spins", Ns_ObjvInt,   &spins,   &spinsRange},
+        {"-time",  Ns_ObjvTime,  &timePtr, &timeRange},
+        {"--",     Ns_ObjvBreak, NULL,     NULL},
+        {NULL, NULL, NULL, NULL}
+    };
+    Ns_ObjvSpec args[] = {
+        {"loop-id", Ns_ObjvObj, &idObj, NULL},
+        {NULL, NULL, NULL, NULL}
+    };
+
+    if (Ns_ParseObjv(opts, args, interp, 1, objc, objv) != NS_OK) {
+        return TCL_ERROR;
+    }
+
+    if ((loopPtr = GetLoop(interp, idObj, &shardPtr)) == NULL) {
+        return TCL_ERROR;
+    }
+
+    if (spins >= 0 || timePtr != NULL) {
+        if (!loopPtr->budgetChanged) {
+            loopPtr->newBudget = loopPtr->budget;
+            loopPtr->budgetChanged = NS_TRUE;
+        }
+        if (spins >= 0) {
+            loopPtr->newBudget.spins = (unsigned int)spins;
+        }
+        if (timePtr != NULL) {
+            loopPtr->newBudget.time = *timePtr;
+        }
+        LOOPCTL_STORE(&loopPtr->attention, 1);
+    }
+    budgetPtr = loopPtr->budgetChanged ? &loopPtr->newBudget : &loopPtr->budget;
+    Ns_TclPrintfResult(interp, "spins %u time " NS_TIME_FMT,
+                       budgetPtr->spins, (int64_t) budgetPtr->time.sec, budgetPtr->time.usec);
+
+    Ns_MutexUnlock(&shardPtr->lock);
+
+    return TCL_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * GranularityObjCmd --
+ *
+ *      Implements loopctl_granularity: query or change the number of
+ *      spins between two polls for control requests of a running
+ *      loop. A value of 0 adapts the granularity to the time per spin.
+ *
+ * Results:
+ *      A standard Tcl result.
+ *
+ * Side effects:
+ *      The loop applies the new granularity at its next poll.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+GranularityObjCmd(ClientData UNUSED(clientData), Tcl_Interp *interp, TCL_SIZE_T objc, Tcl_Obj *const objv[])
+{
+    LoopData          *loopPtr;
+    Shard             *shardPtr;
+    Tcl_Obj           *idObj = NULL;
+    int                spins = -1;
+    Ns_ObjvValueRange  spinsRange = {0, (Tcl_WideInt)LOOPCTL_GRANULARITY_MAX};
+    Ns_ObjvSpec args[] = {
+        {"loop-id", Ns_ObjvObj, &idObj,  NULL},
+        {"?spins",  Ns_ObjvInt, &spins,  &spinsRange},
+        {NULL, NULL, NULL, NULL}
+    };
+
+    if (Ns_ParseObjv(NULL, args, interp, 1, objc, objv) != NS_OK) {
+        return TCL_ERROR;
+    }
+
+    if ((loopPtr = GetLoop(interp, idObj, &shardPtr)) == NULL) {
+        return TCL_ERROR;
+    }
+
+    if (spins >= 0) {
+        loopPtr->newGranularity = (unsigned int)spins;
+        loopPtr->granularityChanged = NS_TRUE;
+        LOOPCTL_STORE(&loopPtr->attention, 1);
+    }
+    Tcl_SetObjResult(interp, Tcl_NewIntObj(
+                         (int)(loopPtr->granularityChanged
+                               ? loopPtr->newGranularity : loopPtr->granularity)));
+
+    Ns_MutexUnlock(&shardPtr->lock);
+
+    return TCL_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * EvalObjCmd --
+ *
+ *      Implements loopctl_eval: evaluate the given script in the context
+ *      of a running loop. The script is queued for the loop, and the
+ *      result is either waited for or, with -async, can be collected
+ *      later with loopctl_wait and loopctl_result via the returned
+ *      handle.
+ *
+ * Results:
+ *      A standard Tcl result.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+EvalObjCmd(ClientData clientData, Tcl_Interp *interp, TCL_SIZE_T objc, Tcl_Obj *const objv[])
+{
+    const ServerData *serverPtr = clientData;
+    ThreadData *threadPtr;
+    LoopData   *loopPtr;
+    Shard      *shardPtr;
+    EvalData   *evalPtr, **evalPtrPtr;
+    Tcl_Obj    *idObj = NULL, *scriptObj = NULL;
+    Ns_Time    *timeoutPtr = NULL;
+    const Ns_Time *waitPtr;
+    char       *script;
+    uintptr_t   handle;
+    int         async = 0, result, n;
+    TCL_SIZE_T  len;
+    Ns_ObjvSpec opts[] = {
+        {"-async",   Ns_ObjvBool,  &async,      INT2PTR(NS_TRUE)},
+        {"-timeout", Ns_ObjvTime,  &timeoutPtr, NULL},
+        {"--",       Ns_ObjvBreak, NULL,        NULL},
+        {NULL, NULL, NULL, NULL}
+    };
+    Ns_ObjvSpec args[] = {
+        {"loop-id", Ns_ObjvObj, &idObj,     NULL},
+        {"script",  Ns_ObjvObj, &scriptObj, NULL},
+        {NULL, NULL, NULL, NULL}
+    };
+
+    if (Ns_ParseObjv(opts, args, interp, 1, objc, objv) != NS_OK) {
+        return TCL_ERROR;
+    }
+    waitPtr = (timeoutPtr != NULL) ? timeoutPtr : &serverPtr->evalTimeout;
+    threadPtr = GetThreadData();
+
+    if ((loopPtr = GetLoop(interp, idObj, &shardPtr)) == NULL) {
         return TCL_ERROR;
     }
 
-    EnterLoop(&data, objc, objv);
+    n = 0;
+    for (evalPtrPtr = &loopPtr->evalPtr; *evalPtrPtr != NULL; evalPtrPtr = &(*evalPtrPtr)->nextPtr) {
+        n++;
+    }
+    if (n >= LOOPCTL_MAX_EVALS) {
+        Ns_MutexUnlock(&shardPtr->lock);
+        Tcl_SetObjResult(interp, Tcl_NewStringObj("too many evals pending", -1));
+        return TCL_ERROR;
+    }
+    if (async) {
+        Ns_Time now;
+
+        Ns_GetTime(&now);
+        ExpireEvals(shardPtr, &now);
+        if (shardPtr->evals.numEntries >= LOOPCTL_MAX_HANDLES) {
+            Ns_MutexUnlock(&shardPtr->lock);
+            Tcl_SetObjResult(interp, Tcl_NewStringObj("too many eval handles", -1));
+            return TCL_ERROR;
+        }
+    }
 
     /*
-     * Create the object argument array "argObjv". Make sure argObjv is
-     * large enough to hold the objc arguments.
+     * Queue new script to eval. The request is referenced by the
+     * loop and either by the handle or by this caller.
      */
 
-    if (objc > NUM_ARGS) {
-        argObjv = (Tcl_Obj **) ckalloc((size_t)objc * sizeof(Tcl_Obj *));
+    evalPtr = ArenaAlloc(threadPtr, sizeof(EvalData));
+    evalPtr->nextPtr = NULL;
+    evalPtr->state = EVAL_WAIT;
+    evalPtr->refCount = 2;
+    evalPtr->code = TCL_OK;
+    evalPtr->shardPtr = shardPtr;
+    evalPtr->hPtr = NULL;
+    evalPtr->keepTime = serverPtr->evalTimeout;
+    evalPtr->doneTime.sec = 0;
+    evalPtr->doneTime.usec = 0;
+    Ns_CondInit(&evalPtr->cond);
+    ArenaInitString(threadPtr, &evalPtr->result);
+    ArenaInitString(threadPtr, &evalPtr->script);
+    script = Tcl_GetStringFromObj(scriptObj, &len);
+    Tcl_DStringAppend(&evalPtr->script, script, len);
+    *evalPtrPtr = evalPtr;
+    LOOPCTL_STORE(&loopPtr->attention, 1);
+    Ns_CondSignal(&loopPtr->threadPtr->cond);
+
+    if (async) {
+        evalPtr->hPtr = NewEntry(shardPtr, &shardPtr->evals, &handle);
+        Tcl_SetHashValue(evalPtr->hPtr, evalPtr);
+        Tcl_SetObjResult(interp, NewIdObj(handle));
+        result = TCL_OK;
+
+    } else {
+        WaitEval(evalPtr, waitPtr);
+        if (evalPtr->state == EVAL_WAIT) {
+            /*
+             * Still queued, remove it from the loop.
+             */
+
+            for (evalPtrPtr = &loopPtr->evalPtr; *evalPtrPtr != evalPtr;
+                 evalPtrPtr = &(*evalPtrPtr)->nextPtr) {
+                ;
+            }
+            *evalPtrPtr = evalPtr->nextPtr;
+            evalPtr->state = EVAL_DROP;
+            ReleaseEval(evalPtr);
+            Tcl_SetObjResult(interp, Tcl_NewStringObj("timeout: result dropped", -1));
+            CountEvent(COUNT_EVAL_TIMEOUTS);
+            result = TCL_ERROR;
+        } else if (evalPtr->state == EVAL_RUN) {
+            Tcl_SetObjResult(interp, Tcl_NewStringObj("timeout: result dropped", -1));
+            CountEvent(COUNT_EVAL_TIMEOUTS);
+            result = TCL_ERROR;
+        } else {
+            result = EvalResult(interp, evalPtr);
+        }
+        ReleaseEval(evalPtr);
     }
-    for (i = 0;  i < objc;  i++) {
-        argObjv[i] = objv[i];
+    Ns_MutexUnlock(&shardPtr->lock);
+
+    return result;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * WaitObjCmd, ResultObjCmd --
+ *
+ *      Implements loopctl_wait and loopctl_result: wait for an async
+ *      eval request to complete. loopctl_wait returns 1 when the
+ *      request is completed and 0 on timeout. loopctl_result returns
+ *      the result of the script and releases the handle, unless the
+ *      timeout expires. With -discard, loopctl_result releases the
+ *      handle without waiting.
+ *
+ * Results:
+ *      A standard Tcl result.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+WaitObjCmd(ClientData clientData, Tcl_Interp *interp, TCL_SIZE_T objc, Tcl_Obj *const objv[])
+{
+    return WaitResult(clientData, interp, objc, objv, NS_FALSE);
+}
+
+static int
+ResultObjCmd(ClientData clientData, Tcl_Interp *interp, TCL_SIZE_T objc, Tcl_Obj *const objv[])
+{
+    return WaitResult(clientData, interp, objc, objv, NS_TRUE);
+}
+
+static int
+WaitResult(ClientData clientData, Tcl_Interp *interp, TCL_SIZE_T objc, Tcl_Obj *const objv[],
+           bool collect)
+{
+    const ServerData *serverPtr = clientData;
+    EvalData   *evalPtr;
+    Shard      *shardPtr;
+    Tcl_Obj    *handleObj = NULL;
+    Ns_Time    *timeoutPtr = NULL;
+    const Ns_Time *waitPtr;
+    int         result, discard = 0;
+    bool        completed;
+    Ns_ObjvSpec waitOpts[] = {
+        {"-timeout", Ns_ObjvTime,  &timeoutPtr, NULL},
+        {"--",       Ns_ObjvBreak, NULL,        NULL},
+        {NULL, NULL, NULL, NULL}
+    };
+    Ns_ObjvSpec resultOpts[] = {
+        {"-timeout", Ns_ObjvTime,  &timeoutPtr, NULL},
+        {"-discard", Ns_ObjvBool,  &discard,    INT2PTR(NS_TRUE)},
+        {"--",       Ns_ObjvBreak, NULL,        NULL},
+        {NULL, NULL, NULL, NULL}
+    };
+    Ns_ObjvSpec args[] = {
+        {"handle", Ns_ObjvObj, &handleObj, NULL},
+        {NULL, NULL, NULL, NULL}
+    };
+
+    if (Ns_ParseObjv(collect ? resultOpts : waitOpts, args, interp, 1, objc, objv) != NS_OK) {
+        return TCL_ERROR;
+    }
+    waitPtr = (timeoutPtr != NULL) ? timeoutPtr : &serverPtr->evalTimeout;
+
+    if ((evalPtr = GetEval(interp, handleObj, &shardPtr)) == NULL) {
+        return TCL_ERROR;
+    }
+    if (discard) {
+        /*
+         * A queued script is still evaluated, but its result is
+         * dropped with the last reference.
+         */
+
+        Tcl_DeleteHashEntry(evalPtr->hPtr);
+        evalPtr->hPtr = NULL;
+        ReleaseEval(evalPtr);
+        Ns_MutexUnlock(&shardPtr->lock);
+        return TCL_OK;
+    }
+    evalPtr->refCount++;
+    WaitEval(evalPtr, waitPtr);
+    completed = (evalPtr->state == EVAL_DONE || evalPtr->state == EVAL_DROP);
+
+    if (!collect) {
+        Tcl_SetObjResult(interp, Tcl_NewBooleanObj(completed));
+        result = TCL_OK;
+    } else if (!completed) {
+        Tcl_SetObjResult(interp, Tcl_NewStringObj("timeout", -1));
+        result = TCL_ERROR;
+    } else {
+        result = EvalResult(interp, evalPtr);
+        if (evalPtr->hPtr != NULL) {
+            Tcl_DeleteHashEntry(evalPtr->hPtr);
+            evalPtr->hPtr = NULL;
+            ReleaseEval(evalPtr);
+        }
     }
+    ReleaseEval(evalPtr);
+    Ns_MutexUnlock(&shardPtr->lock);
+
+    return result;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * PauseObjCmd, RunObjCmd, CancelObjCmd, ThrottleObjCmd --
+ *
+ *      Implements loopctl_pause, loopctl_run, loopctl_cancel and
+ *      loopctl_throttle: send control signal to a loop.
+ *
+ * Results:
+ *      A standard Tcl result.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+PauseObjCmd(ClientData clientData, Tcl_Interp *interp, TCL_SIZE_T objc, Tcl_Obj *const objv[])
+{
+    return Signal(clientData, interp, objc, objv, LOOP_PAUSE);
+}
+
+static int
+RunObjCmd(ClientData clientData, Tcl_Interp *interp, TCL_SIZE_T objc, Tcl_Obj *const objv[])
+{
+    return Signal(clientData, interp, objc, objv, LOOP_RUN);
+}
+
+static int
+CancelObjCmd(ClientData clientData, Tcl_Interp *interp, TCL_SIZE_T objc, Tcl_Obj *const objv[])
+{
+    return Signal(clientData, interp, objc, objv, LOOP_CANCEL);
+}
+
+static int
+ThrottleObjCmd(ClientData clientData, Tcl_Interp *interp, TCL_SIZE_T objc, Tcl_Obj *const objv[])
+{
+    return Signal(clientData, interp, objc, objv, LOOP_THROTTLE);
+}
+
+static int
+Signal(ClientData UNUSED(clientData), Tcl_Interp *interp, TCL_SIZE_T objc, Tcl_Obj *const objv[],
+       LoopControl signal)
+{
+    LoopData       *loopPtr;
+    Shard          *shardPtr;
+    Tcl_HashSearch  search;
+    Tcl_HashEntry  *hPtr;
+    Tcl_Obj        *listPtr, *const *idv, **listv;
+    Ns_Time         elapsed, *timeoutPtr = NULL;
+    Selector        sel = {NULL, 0, NULL, 0, NULL, {0, 0}, 0u, 0u};
+    TCL_SIZE_T      nargs = 0, listc, i;
+    uintptr_t       self;
+    bool            explicit;
+    unsigned int    n;
+    uintptr_t       id;
+    int             skip;
+    Throttle        throttle = {0, 0};
+    Ns_ObjvTimeRange timeRange = {{0, 0}, {LONG_MAX, 0}};
+    Ns_ObjvValueRange rateRange = {0, INT_MAX}, dutyRange = {0, 100};
+    Ns_ObjvSpec opts[] = {
+        {"-rate",       Ns_ObjvInt,    &throttle.rate,     &rateRange},
+        {"-duty",       Ns_ObjvInt,    &throttle.duty,     &dutyRange},
+        {"-timeout",    Ns_ObjvTime,   &timeoutPtr,        &timeRange},
+        {"-thread",     Ns_ObjvString, &sel.thread,        NULL},
+        {"-minelapsed", Ns_ObjvTime,   &sel.minElapsedPtr, NULL},
+        {"-match",      Ns_ObjvString, &sel.pattern,       NULL},
+        {"--",          Ns_ObjvBreak,  NULL,               NULL},
+        {NULL, NULL, NULL, NULL}
+    };
+    Ns_ObjvSpec args[] = {
+        {"?loop-id", Ns_ObjvArgs, &nargs, NULL},
+        {NULL, NULL, NULL, NULL}
+    };
 
     /*
-     * Manage numList parallel value lists.
-     * argvList[i] is a value list counted by argcList[i]
-     * varvList[i] is the list of variables associated with the value list
-     * varcList[i] is the number of variables associated with the value list
-     * index[i] is the current pointer into the value list argvList[i]
+     * The -rate and -duty options are only supported by
+     * loopctl_throttle, -timeout by loopctl_pause and
+     * loopctl_throttle.
      */
 
-    numLists = (objc-2)/2;
-    if (numLists > STATIC_LIST_SIZE) {
-        index =    (TCL_SIZE_T *) ckalloc((size_t)numLists * sizeof(TCL_SIZE_T));
-        varcList = (TCL_SIZE_T *) ckalloc((size_t)numLists * sizeof(TCL_SIZE_T));
-        varvList = (Tcl_Obj ***) ckalloc((size_t)numLists * sizeof(Tcl_Obj **));
-        argcList = (TCL_SIZE_T *) ckalloc((size_t)numLists * sizeof(TCL_SIZE_T));
-        argvList = (Tcl_Obj ***) ckalloc((size_t)numLists * sizeof(Tcl_Obj **));
+    skip = (signal == LOOP_THROTTLE) ? 0 : (signal == LOOP_PAUSE) ? 2 : 3;
+    if (Ns_ParseObjv(opts + skip, args, interp, 1, objc, objv) != NS_OK
+        || InitSelector(interp, &sel) != TCL_OK) {
+        return TCL_ERROR;
     }
-    for (i = 0;  i < numLists;  i++) {
-        index[i] = 0;
-        varcList[i] = 0;
-        varvList[i] = (Tcl_Obj **) NULL;
-        argcList[i] = 0;
-        argvList[i] = (Tcl_Obj **) NULL;
+    idv = objv + (objc - nargs);
+    explicit = (nargs > 0);
+
+    /*
+     * A single argument may be a list of IDs, e.g. the result of
+     * loopctl_loops.
+     */
+
+    if (nargs == 1 && idv[0]->typePtr != &idType
+        && Tcl_ListObjGetElements(NULL, idv[0], &listc, &listv) == TCL_OK) {
+        idv = listv;
+        nargs = listc;
+    }
+
+    if (signal == LOOP_THROTTLE && throttle.rate == 0 && throttle.duty == 0) {
+        Tcl_SetObjResult(interp, Tcl_NewStringObj("missing -rate or -duty", -1));
+        return TCL_ERROR;
+    }
+
+    /*
+     * A duty cycle of 100% does not limit the loop, without a rate it
+     * ends the throttle.
+     */
+
+    if (signal == LOOP_THROTTLE && throttle.duty == 100) {
+        throttle.duty = 0;
+        if (throttle.rate == 0) {
+            signal = LOOP_RUN;
+        }
+    }
+    if (sel.thread == NULL && sel.minElapsedPtr == NULL && sel.pattern == NULL) {
+        if (!explicit) {
+            static const char *const usage[] = {
+                "?-rate spins? ?-duty percent? ?-timeout time? ",
+                "", "?-timeout time? ", ""
+            };
+
+            Ns_TclPrintfResult(interp, "wrong # args: should be \"%s %s"
+                               "?-thread thread-id? ?-minelapsed time? ?-match pattern? ?loop-id ...?\"",
+                               Tcl_GetString(objv[0]), usage[skip]);
+            return TCL_ERROR;
+        }
+        if (nargs == 1) {
+            if ((loopPtr = GetLoop(interp, idv[0], &shardPtr)) == NULL) {
+                return TCL_ERROR;
+            }
+            SendSignal(loopPtr, signal, timeoutPtr, &throttle);
+            Ns_MutexUnlock(&shardPtr->lock);
+
+            return TCL_OK;
+        }
+    }
+
+    /*
+     * Batch form: visit each shard once and return the IDs of the
+     * signaled loops. Loops which have exited already are skipped.
+     * Without explicit IDs, the loops of the calling thread are not
+     * selected, such that e.g. pausing all loops does not block the
+     * caller.
+     */
+
+    listPtr = Tcl_NewListObj(0, NULL);
+    self = Ns_ThreadId();
+
+    for (n = sel.first; n <= sel.last; n++) {
+        shardPtr = &shards[n];
+
+        Ns_MutexLock(&shardPtr->lock);
+        if (explicit) {
+            for (i = 0; i < nargs; i++) {
+                if (GetId(NULL, idv[i], &id) != TCL_OK
+                    || (id & (LOOPCTL_SHARDS - 1u)) != n
+                    || (hPtr = Tcl_FindHashEntry(&shardPtr->loops, (const char *)id)) == NULL) {
+                    continue;
+                }
+                loopPtr = Tcl_GetHashValue(hPtr);
+                if (MatchLoop(loopPtr, &sel, &elapsed)) {
+                    SendSignal(loopPtr, signal, timeoutPtr, &throttle);
+                    Tcl_ListObjAppendElement(NULL, listPtr, idv[i]);
+                }
+            }
+        } else {
+            hPtr = Tcl_FirstHashEntry(&shardPtr->loops, &search);
+            while (hPtr != NULL) {
+                loopPtr = Tcl_GetHashValue(hPtr);
+                if ((sel.thread != NULL || loopPtr->tid != self)
+                    && MatchLoop(loopPtr, &sel, &elapsed)) {
+                    SendSignal(loopPtr, signal, timeoutPtr, &throttle);
+                    Tcl_ListObjAppendElement(NULL, listPtr, NewIdObj(loopPtr->lid));
+                }
+                hPtr = Tcl_NextHashEntry(&search);
+            }
+        }
+        Ns_MutexUnlock(&shardPtr->lock);
+    }
+    Tcl_SetObjResult(interp, listPtr);
+
+    return TCL_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * SendSignal --
+ *
+ *      Set the control state of a loop and wake up its thread. A pause
+ *      ends after the given timeout or the configured "maxpause",
+ *      whichever is shorter, a throttle after the given timeout. A
+ *      cancel extends to the loops nested in the canceled one, until
+ *      it is observed or overridden by another signal. Must be called
+ *      with the shard of the loop locked.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static bool
+ControlExpired(LoopData *loopPtr, const Ns_Time *nowPtr)
+{
+    if ((loopPtr->controlUntil.sec == 0 && loopPtr->controlUntil.usec == 0)
+        || Ns_DiffTime(&loopPtr->controlUntil, nowPtr, NULL) > 0) {
+        return NS_FALSE;
+    }
+    Ns_Log(Notice, "nsloopctl: loop %" PRIxPTR " resumed after %s timeout", loopPtr->lid,
+           loopPtr->control == LOOP_PAUSE ? "pause" : "throttle");
+    loopPtr->control = LOOP_RUN;
+    loopPtr->controlUntil.sec = 0;
+    loopPtr->controlUntil.usec = 0;
+    LogEvent(EVENT_RESUME, loopPtr);
+
+    return NS_TRUE;
+}
+
+static bool
+Canceled(const LoopData *loopPtr)
+{
+    unsigned int cancelDepth = loopPtr->threadPtr->cancelDepth;
+
+    return loopPtr->control == LOOP_CANCEL
+        || (cancelDepth != 0u && loopPtr->depth > cancelDepth);
+}
+
+static void
+SendSignal(LoopData *loopPtr, LoopControl signal, const Ns_Time *timeoutPtr,
+           const Throttle *throttlePtr)
+{
+    const Ns_Time *maxPausePtr = &loopPtr->serverPtr->maxPause;
+
+    loopPtr->controlUntil.sec = 0;
+    loopPtr->controlUntil.usec = 0;
+    if (signal == LOOP_PAUSE && (maxPausePtr->sec > 0 || maxPausePtr->usec > 0)) {
+        if (timeoutPtr == NULL || Ns_DiffTime(timeoutPtr, maxPausePtr, NULL) > 0) {
+            timeoutPtr = maxPausePtr;
+        }
+    }
+    if (timeoutPtr != NULL && (signal == LOOP_PAUSE || signal == LOOP_THROTTLE)) {
+        Ns_GetTime(&loopPtr->controlUntil);
+        Ns_IncrTime(&loopPtr->controlUntil, timeoutPtr->sec, timeoutPtr->usec);
+    }
+    if (loopPtr->control == LOOP_CANCEL && signal != LOOP_CANCEL
+        && loopPtr->depth == loopPtr->threadPtr->cancelDepth) {
+        ThreadData     *threadPtr = loopPtr->threadPtr;
+        const LoopData *otherPtr;
+
+        /*
+         * A pending cancel is overridden. The nested loops stop only
+         * for the outermost loop of the thread which remains canceled,
+         * if any.
+         */
+
+        threadPtr->cancelDepth = 0u;
+        for (otherPtr = threadPtr->loopPtr; otherPtr != NULL; otherPtr = otherPtr->parentPtr) {
+            if (otherPtr != loopPtr && otherPtr->control == LOOP_CANCEL) {
+                threadPtr->cancelDepth = otherPtr->depth;
+            }
+        }
+    }
+    if (signal == LOOP_THROTTLE) {
+        loopPtr->throttle = *throttlePtr;
+        CountEvent(COUNT_THROTTLES);
+        LogEvent(EVENT_THROTTLE, loopPtr);
+    } else if (signal == LOOP_PAUSE) {
+        CountEvent(COUNT_PAUSES);
+        LogEvent(EVENT_PAUSE, loopPtr);
+    } else if (signal == LOOP_RUN) {
+        LogEvent(EVENT_RESUME, loopPtr);
+    } else if (signal == LOOP_CANCEL) {
+        ThreadData *threadPtr = loopPtr->threadPtr;
+        LoopData   *innerPtr;
+
+        /*
+         * The loops nested in the canceled one stop as well. They find
+         * the canceled ancestor via the cancel depth of their thread on
+         * their next check.
+         */
+
+        if (threadPtr->cancelDepth == 0u || loopPtr->depth < threadPtr->cancelDepth) {
+            threadPtr->cancelDepth = loopPtr->depth;
+        }
+        for (innerPtr = threadPtr->loopPtr; innerPtr != loopPtr; innerPtr = innerPtr->parentPtr) {
+            LOOPCTL_STORE(&innerPtr->attention, 1);
+        }
+        CountEvent(COUNT_CANCELS);
+        LogEvent(EVENT_CANCEL, loopPtr);
+    }
+    loopPtr->control = signal;
+    LOOPCTL_STORE(&loopPtr->attention, 1);
+    if (signal == LOOP_PAUSE || signal == LOOP_CANCEL) {
+        LOOPCTL_STORE(&loopPtr->threadPtr->attention, 1);
+    }
+    Ns_CondSignal(&loopPtr->threadPtr->cond);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * AbortObjCmd, AbortThread, AbortLoop --
+ *
+ *      Implements loopctl_abort: abort a running thread using Tcl
+ *      async signals, or via the limit engine if enabled. With -loop,
+ *      only the interp running the given loop is canceled, unwinding
+ *      all its script levels (Tcl 8.6 and newer). The times of the
+ *      request and of its delivery are kept for loopctl_threads.
+ *      AbortThread must be called with the shard of the thread
+ *      locked.
+ *
+ * Results:
+ *      A standard Tcl result.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+AbortObjCmd(ClientData UNUSED(clientData), Tcl_Interp *interp, TCL_SIZE_T objc, Tcl_Obj *const objv[])
+{
+    char           *id, *end;
+    Tcl_HashEntry  *hPtr = NULL;
+    Shard          *shardPtr;
+    Tcl_Obj        *idObj = NULL;
+    uintptr_t       tid;
+    int             loop = 0, result;
+    Ns_ObjvSpec opts[] = {
+        {"-loop", Ns_ObjvBool,  &loop, INT2PTR(NS_TRUE)},
+        {"--",    Ns_ObjvBreak, NULL,  NULL},
+        {NULL, NULL, NULL, NULL}
+    };
+    Ns_ObjvSpec args[] = {
+        {"id", Ns_ObjvObj, &idObj, NULL},
+        {NULL, NULL, NULL, NULL}
+    };
+
+    if (Ns_ParseObjv(opts, args, interp, 1, objc, objv) != NS_OK) {
+        return TCL_ERROR;
+    }
+    if (loop != 0) {
+        return AbortLoop(interp, idObj);
+    }
+    id = Tcl_GetString(idObj);
+    tid = (uintptr_t) strtoull(id, &end, 16);
+    shardPtr = GetShard(tid);
+
+    Ns_MutexLock(&shardPtr->lock);
+    if (*end == '\0') {
+        hPtr = Tcl_FindHashEntry(&shardPtr->threads, id);
+    }
+    if (hPtr != NULL) {
+        AbortThread(Tcl_GetHashValue(hPtr));
+        result = TCL_OK;
+    } else {
+        Tcl_AppendResult(interp, "no such active thread: ", id, NULL);
+        result = TCL_ERROR;
+    }
+    Ns_MutexUnlock(&shardPtr->lock);
+
+    return result;
+}
+
+static void
+AbortThread(ThreadData *threadPtr)
+{
+    Ns_GetTime(&threadPtr->abortSent);
+    threadPtr->abortAck.sec = 0;
+    threadPtr->abortAck.usec = 0;
+#ifdef TCL_CANCEL_UNWIND
+    if (threadPtr->limited) {
+        /*
+         * The abort is delivered by the limit handler, or by the next
+         * check of the innermost loop, whichever comes first.
+         */
+
+        threadPtr->abort = NS_TRUE;
+        LOOPCTL_STORE(&threadPtr->attention, 1);
+        if (threadPtr->loopPtr != NULL) {
+            LOOPCTL_STORE(&threadPtr->loopPtr->attention, 1);
+        }
+        Ns_CondSignal(&threadPtr->cond);
+    } else
+#endif
+    {
+        Tcl_AsyncMark(threadPtr->cancel);
+    }
+}
+
+static int
+AbortLoop(Tcl_Interp *interp, Tcl_Obj *idObj)
+{
+#ifdef TCL_CANCEL_UNWIND
+    LoopData *loopPtr;
+    Shard    *shardPtr;
+
+    if ((loopPtr = GetLoop(interp, idObj, &shardPtr)) == NULL) {
+        return TCL_ERROR;
+    }
+    loopPtr->abortSent = NS_TRUE;
+    Ns_GetTime(&loopPtr->threadPtr->abortSent);
+    loopPtr->threadPtr->abortAck.sec = 0;
+    loopPtr->threadPtr->abortAck.usec = 0;
+    (void) Tcl_CancelEval(loopPtr->interp, Tcl_NewStringObj(
+                              "nsloopctl: loop aborted: returning TCL_ERROR", -1),
+                          NULL, TCL_CANCEL_UNWIND);
+    Ns_MutexUnlock(&shardPtr->lock);
+
+    return TCL_OK;
+#else
+    (void) idObj;
+    Tcl_SetObjResult(interp, Tcl_NewStringObj("loop abort requires Tcl 8.6 or newer", -1));
+
+    return TCL_ERROR;
+#endif
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ForObjCmd --
+ *
+ *      This procedure is invoked to process the "for" Tcl command.
+ *      See the user documentation for details on what it does.
+ *
+ *      With the bytecode compiler, this procedure is only called when
+ *      a command name is computed at runtime, and is "for" or the name
+ *      to which "for" was renamed: e.g.,
+ *      "set z for; $z {set i 0} {$i<100} {incr i} {puts $i}"
+ *
+ *      Copied from the Tcl source with additional calls to the
+ *      loop control facility.
+ *
+ * Results:
+ *      A standard Tcl result.
+ *
+ * Side effects:
+ *      See the user documentation.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+ForObjCmd(ClientData clientData, Tcl_Interp *interp, TCL_SIZE_T objc, Tcl_Obj *const objv[])
+{
+    LoopData  data;
+    FastLoop  fast;
+    Tcl_Obj  *argObjv[5];
+    int       result, value, i;
+
+    if (objc != 5) {
+        Tcl_WrongNumArgs(interp, 1, objv, "start test next command");
+        return TCL_ERROR;
+    }
+
+    result = Tcl_EvalObjEx(interp, objv[1], 0);
+    if (result != TCL_OK) {
+        if (result == TCL_ERROR) {
+            Tcl_AddErrorInfo(interp, "\n    (\"for\" initial command)");
+        }
+        return result;
+    }
+
+    /*
+     * Pin the args in a local array, see ForeachObjCmd. The objects
+     * keep their compiled expression and bytecode for all spins.
+     */
+
+    for (i = 0; i < 5; i++) {
+        argObjv[i] = objv[i];
+        Tcl_IncrRefCount(argObjv[i]);
+    }
+    InitFastLoop(interp, &fast, argObjv[2], argObjv[3]);
+    EnterLoop(clientData, interp, &data, objc, argObjv);
+
+    while (1) {
+        result = FastCondition(interp, &fast, &value);
+        if (result == TCL_CONTINUE) {
+            /*
+             * We need to reset the result before passing it off to
+             * Tcl_ExprBooleanObj.  Otherwise, any error message will be
+             * appended to the result of the last evaluation.
+             */
+
+            Tcl_ResetResult(interp);
+            result = Tcl_ExprBooleanObj(interp, argObjv[2], &value);
+        }
+        if (result != TCL_OK) {
+            goto done;
+        }
+        if (!value) {
+            break;
+        }
+        result = CheckControl(interp, &data);
+        if (result == TCL_OK) {
+            result = Tcl_EvalObjEx(interp, argObjv[4], 0);
+        }
+        if ((result != TCL_OK) && (result != TCL_CONTINUE)) {
+            if (result == TCL_ERROR) {
+                char msg[32 + TCL_INTEGER_SPACE];
+
+                sprintf(msg, "\n    (\"for\" body line %d)",Tcl_GetErrorLine(interp));
+                Tcl_AddErrorInfo(interp, msg);
+            }
+            break;
+        }
+
+        result = FastIncr(interp, &fast);
+        if (result == TCL_CONTINUE) {
+            result = Tcl_EvalObjEx(interp, argObjv[3], 0);
+        }
+
+        if (result == TCL_BREAK) {
+            break;
+        } else if (result != TCL_OK) {
+            if (result == TCL_ERROR) {
+                Tcl_AddErrorInfo(interp, "\n    (\"for\" loop-end command)");
+            }
+            goto done;
+        }
+    }
+    if (result == TCL_BREAK) {
+        result = TCL_OK;
+    }
+    if (result == TCL_OK) {
+        Tcl_ResetResult(interp);
+    }
+ done:
+    LeaveLoop(&data);
+    FreeFastLoop(&fast);
+    for (i = 0; i < 5; i++) {
+        Tcl_DecrRefCount(argObjv[i]);
+    }
+
+    return result;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * WhileObjCmd --
+ *
+ *      This procedure is invoked to process the "while" Tcl command.
+ *      See the user documentation for details on what it does.
+ *
+ *      With the bytecode compiler, this procedure is only called when
+ *      a command name is computed at runtime, and is "while" or the name
+ *      to which "while" was renamed: e.g., "set z while; $z {$i<100} {}"
+ *
+ *      Copied from the Tcl source with additional calls to the
+ *      loop control facility.
+ *
+ * Results:
+ *      A standard Tcl result.
+ *
+ * Side effects:
+ *      See the user documentation.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+WhileObjCmd(ClientData clientData, Tcl_Interp *interp, TCL_SIZE_T objc, Tcl_Obj *const objv[])
+{
+    LoopData  data;
+    FastLoop  fast;
+    Tcl_Obj  *argObjv[3];
+    int       result, value, i;
+
+    if (objc != 3) {
+        Tcl_WrongNumArgs(interp, 1, objv, "test command");
+        return TCL_ERROR;
+    }
+
+    for (i = 0; i < 3; i++) {
+        argObjv[i] = objv[i];
+        Tcl_IncrRefCount(argObjv[i]);
+    }
+    InitFastLoop(interp, &fast, argObjv[1], NULL);
+    EnterLoop(clientData, interp, &data, objc, argObjv);
+
+    while (1) {
+        result = FastCondition(interp, &fast, &value);
+        if (result == TCL_CONTINUE) {
+            result = Tcl_ExprBooleanObj(interp, argObjv[1], &value);
+        }
+        if (result != TCL_OK) {
+            goto done;
+        }
+        if (!value) {
+            break;
+        }
+        result = CheckControl(interp, &data);
+        if (result == TCL_OK) {
+            result = Tcl_EvalObjEx(interp, argObjv[2], 0);
+        }
+        if ((result != TCL_OK) && (result != TCL_CONTINUE)) {
+            if (result == TCL_ERROR) {
+                char msg[32 + TCL_INTEGER_SPACE];
+
+                sprintf(msg, "\n    (\"while\" body line %d)",
+                        Tcl_GetErrorLine(interp));
+                Tcl_AddErrorInfo(interp, msg);
+            }
+            break;
+        }
+    }
+    if (result == TCL_BREAK) {
+        result = TCL_OK;
+    }
+    if (result == TCL_OK) {
+        Tcl_ResetResult(interp);
+    }
+ done:
+    LeaveLoop(&data);
+    FreeFastLoop(&fast);
+    for (i = 0; i < 3; i++) {
+        Tcl_DecrRefCount(argObjv[i]);
+    }
+
+    return result;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ParseName --
+ *
+ *      Parse a plain variable name of letters, digits and underscores
+ *      for the fast path of a loop. Array elements and namespace
+ *      qualified names are left to the generic evaluation.
+ *
+ * Results:
+ *      Pointer to the character after the name, or NULL when there is
+ *      no name at p.
+ *
+ * Side effects:
+ *      A name object with a reference is returned in *namePtrPtr.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static const char *
+ParseName(const char *p, Tcl_Obj **namePtrPtr)
+{
+    const char *start = p;
+
+    while (isalnum(UCHAR(*p)) || *p == '_') {
+        p++;
+    }
+    if (p == start) {
+        return NULL;
+    }
+    *namePtrPtr = Tcl_NewStringObj(start, (TCL_SIZE_T)(p - start));
+    Tcl_IncrRefCount(*namePtrPtr);
+
+    return p;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ParseInteger --
+ *
+ *      Parse a decimal integer that fits a wide int for the fast path
+ *      of a loop.
+ *
+ * Results:
+ *      Pointer to the character after the integer, or NULL when there
+ *      is no such integer at p.
+ *
+ * Side effects:
+ *      The value is returned in *valuePtr.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static const char *
+ParseInteger(const char *p, Tcl_WideInt *valuePtr)
+{
+    const char *start = p;
+    char       *end;
+
+    /*
+     * Only decimals without leading zeros, which have the same
+     * value in every Tcl version.
+     */
+
+    if (*p == '-') {
+        p++;
+    }
+    if (!isdigit(UCHAR(*p)) || (*p == '0' && isdigit(UCHAR(p[1])))) {
+        return NULL;
+    }
+    errno = 0;
+    *valuePtr = (Tcl_WideInt) strtoll(start, &end, 10);
+    if (errno != 0) {
+        return NULL;
+    }
+    return end;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * InitFastLoop --
+ *
+ *      Recognize a loop condition of the form "$var op $var" or
+ *      "$var op integer", and a next clause of the form "incr var
+ *      ?integer?", where the variable names are plain identifiers.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Variable name objects are allocated for the fast path.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+InitFastLoop(Tcl_Interp *interp, FastLoop *fastPtr, Tcl_Obj *condPtr, Tcl_Obj *nextPtr)
+{
+    static const struct {
+        const char *op;
+        FastOp      fastOp;
+    } ops[] = {
+        {"<=", FAST_LE}, {">=", FAST_GE}, {"==", FAST_EQ}, {"!=", FAST_NE},
+        {"<",  FAST_LT}, {">",  FAST_GT}
+    };
+    const char *p;
+    size_t      i;
+    Tcl_CmdInfo info;
+
+    fastPtr->varPtr = NULL;
+    fastPtr->limitVarPtr = NULL;
+    fastPtr->incrVarPtr = NULL;
+
+    p = Tcl_GetString(condPtr);
+    while (isspace(UCHAR(*p))) {
+        p++;
+    }
+    if (*p == '$' && (p = ParseName(p + 1, &fastPtr->varPtr)) != NULL) {
+        while (isspace(UCHAR(*p))) {
+            p++;
+        }
+        for (i = 0u; i < sizeof(ops) / sizeof(ops[0]); i++) {
+            if (strncmp(p, ops[i].op, strlen(ops[i].op)) == 0) {
+                break;
+            }
+        }
+        if (i < sizeof(ops) / sizeof(ops[0])) {
+            fastPtr->op = ops[i].fastOp;
+            p += strlen(ops[i].op);
+            while (isspace(UCHAR(*p))) {
+                p++;
+            }
+            if (*p == '$') {
+                p = ParseName(p + 1, &fastPtr->limitVarPtr);
+            } else {
+                p = ParseInteger(p, &fastPtr->limit);
+            }
+            while (p != NULL && isspace(UCHAR(*p))) {
+                p++;
+            }
+        } else {
+            p = NULL;
+        }
+        if (p == NULL || *p != '\0') {
+            FreeFastLoop(fastPtr);
+        }
+    }
+
+    if (nextPtr != NULL && incrProc != NULL) {
+        p = Tcl_GetString(nextPtr);
+        while (isspace(UCHAR(*p))) {
+            p++;
+        }
+        if (strncmp(p, "incr", 4u) == 0 && isspace(UCHAR(p[4]))
+            && Tcl_GetCommandInfo(interp, "incr", &info) != 0 && info.objProc == incrProc) {
+            p += 4;
+            while (isspace(UCHAR(*p))) {
+                p++;
+            }
+            if ((p = ParseName(p, &fastPtr->incrVarPtr)) != NULL) {
+                fastPtr->step = 1;
+                while (isspace(UCHAR(*p))) {
+                    p++;
+                }
+                if (*p != '\0' && (p = ParseInteger(p, &fastPtr->step)) != NULL) {
+                    while (isspace(UCHAR(*p))) {
+                        p++;
+                    }
+                }
+            }
+            if ((p == NULL || *p != '\0') && fastPtr->incrVarPtr != NULL) {
+                Tcl_DecrRefCount(fastPtr->incrVarPtr);
+                fastPtr->incrVarPtr = NULL;
+            }
+        }
+    }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * FreeFastLoop --
+ *
+ *      Release the variable names of the fast path of a loop.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      The fast path is disabled.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+FreeFastLoop(FastLoop *fastPtr)
+{
+    if (fastPtr->varPtr != NULL) {
+        Tcl_DecrRefCount(fastPtr->varPtr);
+        fastPtr->varPtr = NULL;
+    }
+    if (fastPtr->limitVarPtr != NULL) {
+        Tcl_DecrRefCount(fastPtr->limitVarPtr);
+        fastPtr->limitVarPtr = NULL;
+    }
+    if (fastPtr->incrVarPtr != NULL) {
+        Tcl_DecrRefCount(fastPtr->incrVarPtr);
+        fastPtr->incrVarPtr = NULL;
+    }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * GetFastInt --
+ *
+ *      Get the value of a loop variable for the fast path.
+ *
+ * Results:
+ *      True when the variable holds a native integer, false when the
+ *      generic evaluation has to be used.
+ *
+ * Side effects:
+ *      The value might be converted to an integer.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static bool
+GetFastInt(Tcl_Obj *objPtr, Tcl_WideInt *valuePtr)
+{
+    /*
+     * Tcl 8.6 wraps bignums below 2^64 around, so accept only values
+     * which have been converted to a native integer.
+     */
+
+    return Tcl_GetWideIntFromObj(NULL, objPtr, valuePtr) == TCL_OK
+        && objPtr->typePtr != NULL
+        && (objPtr->typePtr == scalarTypes[0] || objPtr->typePtr == scalarTypes[1]);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * FastCondition, FastIncr --
+ *
+ *      Evaluate the loop condition or next clause recognized by
+ *      InitFastLoop.
+ *
+ * Results:
+ *      TCL_CONTINUE if the generic evaluation has to be used, since
+ *      there is no fast path or a variable is not set to an integer.
+ *      Otherwise a standard Tcl result.
+ *
+ * Side effects:
+ *      FastIncr sets the loop variable.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+FastCondition(Tcl_Interp *interp, const FastLoop *fastPtr, int *valuePtr)
+{
+    Tcl_Obj    *objPtr;
+    Tcl_WideInt a, b;
+
+    if (fastPtr->varPtr == NULL
+        || (objPtr = Tcl_ObjGetVar2(interp, fastPtr->varPtr, NULL, 0)) == NULL
+        || !GetFastInt(objPtr, &a)) {
+        return TCL_CONTINUE;
+    }
+    if (fastPtr->limitVarPtr == NULL) {
+        b = fastPtr->limit;
+    } else if ((objPtr = Tcl_ObjGetVar2(interp, fastPtr->limitVarPtr, NULL, 0)) == NULL
+               || !GetFastInt(objPtr, &b)) {
+        return TCL_CONTINUE;
+    }
+
+    switch (fastPtr->op) {
+    case FAST_LT: *valuePtr = (a <  b); break;
+    case FAST_LE: *valuePtr = (a <= b); break;
+    case FAST_GT: *valuePtr = (a >  b); break;
+    case FAST_GE: *valuePtr = (a >= b); break;
+    case FAST_EQ: *valuePtr = (a == b); break;
+    case FAST_NE: *valuePtr = (a != b); break;
+    }
+
+    return TCL_OK;
+}
+
+static int
+FastIncr(Tcl_Interp *interp, const FastLoop *fastPtr)
+{
+    Tcl_Obj    *objPtr;
+    Tcl_WideInt value;
+
+    if (fastPtr->incrVarPtr == NULL
+        || (objPtr = Tcl_ObjGetVar2(interp, fastPtr->incrVarPtr, NULL, 0)) == NULL
+        || !GetFastInt(objPtr, &value)
+        || (fastPtr->step > 0 && value > INT64_MAX - fastPtr->step)
+        || (fastPtr->step < 0 && value < INT64_MIN - fastPtr->step)) {
+        return TCL_CONTINUE;
+    }
+
+    /*
+     * As "incr", modify an unshared value in place. The value is set
+     * again in any case to fire write traces.
+     */
+
+    if (Tcl_IsShared(objPtr)) {
+        objPtr = Tcl_NewWideIntObj(value + fastPtr->step);
+    } else {
+        Tcl_SetWideIntObj(objPtr, value + fastPtr->step);
+    }
+    if (Tcl_ObjSetVar2(interp, fastPtr->incrVarPtr, NULL, objPtr, TCL_LEAVE_ERR_MSG) == NULL) {
+        return TCL_ERROR;
+    }
+    return TCL_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ForeachObjCmd, LmapObjCmd --
+ *
+ *      These object-based procedures are invoked to process the
+ *      "foreach" and "lmap" Tcl commands.  See the user documentation
+ *      for details on what they do.
+ *
+ * Results:
+ *      A standard Tcl object result.
+ *
+ * Side effects:
+ *      See the user documentation.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+ForeachObjCmd(ClientData clientData, Tcl_Interp *interp, TCL_SIZE_T objc, Tcl_Obj *const objv[])
+{
+    return EachLoop(clientData, interp, objc, objv, NS_FALSE);
+}
+
+static int
+LmapObjCmd(ClientData clientData, Tcl_Interp *interp, TCL_SIZE_T objc, Tcl_Obj *const objv[])
+{
+    return EachLoop(clientData, interp, objc, objv, NS_TRUE);
+}
+
+static int
+EachLoop(ClientData clientData, Tcl_Interp *interp, TCL_SIZE_T objc, Tcl_Obj *const objv[],
+         bool collect)
+{
+    LoopData  data;
+    ThreadData *threadPtr;
+    int       result = TCL_OK;
+    const char *cmdName = collect ? "lmap" : "foreach";
+    TCL_SIZE_T       i;              /* i selects a value list */
+    int       j, maxj;        /* Number of loop iterations */
+    int       v;              /* v selects a loop variable */
+    int       numLists;       /* Count of value lists */
+    Tcl_Obj  *bodyPtr;
+    Tcl_Obj  *emptyPtr = NULL; /* Shared padding for exhausted lists */
+    Tcl_Obj  *listPtr = NULL;  /* Collected results of "lmap" */
+
+    /*
+     * We copy the argument object pointers into a local array to avoid
+     * the problem that "objv" might become invalid. It is a pointer into
+     * the evaluation stack and that stack might be grown and reallocated
+     * if the loop body requires a large amount of stack space.
+     */
+
+#define NUM_ARGS 9
+    Tcl_Obj *(argObjStorage[NUM_ARGS]);
+    Tcl_Obj **argObjv = argObjStorage;
+
+#define STATIC_LIST_SIZE 4
+    TCL_SIZE_T indexArray[STATIC_LIST_SIZE];
+    TCL_SIZE_T varcListArray[STATIC_LIST_SIZE];
+    Tcl_Obj  **varvListArray[STATIC_LIST_SIZE];
+    TCL_SIZE_T argcListArray[STATIC_LIST_SIZE];
+    Tcl_Obj  **argvListArray[STATIC_LIST_SIZE];
+    Tcl_Obj   *copyListArray[STATIC_LIST_SIZE * 2];
+
+    TCL_SIZE_T *index = indexArray;          /* Array of value list indices */
+    TCL_SIZE_T *varcList = varcListArray;   /* # loop variables per list */
+    Tcl_Obj  ***varvList = varvListArray;   /* Array of var name lists */
+    TCL_SIZE_T *argcList = argcListArray;   /* Array of value list sizes */
+    Tcl_Obj   ***argvList = argvListArray;   /* Array of value lists */
+    Tcl_Obj    **copyList = copyListArray;   /* Private lists sharing the elements */
+
+    if (objc < 4 || (objc%2 != 0)) {
+        Tcl_WrongNumArgs(interp, 1, objv,
+                         "varList list ?varList list ...? command");
+        return TCL_ERROR;
+    }
+
+    /*
+     * Create the object argument array "argObjv". Make sure argObjv is
+     * large enough to hold the objc arguments. Larger arrays are taken
+     * from the arena of the thread.
+     */
+
+    threadPtr = GetThreadData();
+    if (objc > NUM_ARGS) {
+        argObjv = ArenaAlloc(threadPtr, (size_t)objc * sizeof(Tcl_Obj *));
+    }
+    for (i = 0;  i < objc;  i++) {
+        argObjv[i] = objv[i];
+    }
+
+    EnterLoop(clientData, interp, &data, objc, argObjv);
+
+    /*
+     * Manage numList parallel value lists.
+     * argvList[i] is a value list counted by argcList[i]
+     * varvList[i] is the list of variables associated with the value list
+     * varcList[i] is the number of variables associated with the value list
+     * index[i] is the current pointer into the value list argvList[i]
+     */
+
+    numLists = (objc-2)/2;
+    if (numLists > STATIC_LIST_SIZE) {
+        index =    ArenaAlloc(threadPtr, (size_t)numLists * sizeof(TCL_SIZE_T));
+        varcList = ArenaAlloc(threadPtr, (size_t)numLists * sizeof(TCL_SIZE_T));
+        varvList = ArenaAlloc(threadPtr, (size_t)numLists * sizeof(Tcl_Obj **));
+        argcList = ArenaAlloc(threadPtr, (size_t)numLists * sizeof(TCL_SIZE_T));
+        argvList = ArenaAlloc(threadPtr, (size_t)numLists * sizeof(Tcl_Obj **));
+        copyList = ArenaAlloc(threadPtr, (size_t)numLists * 2u * sizeof(Tcl_Obj *));
+    }
+    for (i = 0;  i < numLists;  i++) {
+        index[i] = 0;
+        varcList[i] = 0;
+        varvList[i] = (Tcl_Obj **) NULL;
+        argcList[i] = 0;
+        argvList[i] = (Tcl_Obj **) NULL;
+        copyList[i*2] = copyList[i*2+1] = NULL;
+    }
+
+    /*
+     * Break up the value lists and variable lists into elements. The
+     * loop iterates over private lists which share the element arrays
+     * of the original lists, see ShareList. Nothing else can reach
+     * them, so the arrays stay valid for the whole loop, even when the
+     * body shimmers or modifies the original lists, and need not be
+     * refetched on every iteration.
+     */
+
+    maxj = 0;
+    for (i = 0;  i < numLists;  i++) {
+        TCL_SIZE_T c;
+        Tcl_Obj  **v;
+
+        result = Tcl_ListObjGetElements(interp, argObjv[1+i*2], &c, &v);
+        if (result != TCL_OK) {
+            goto done;
+        }
+        if (c < 1) {
+            Tcl_AppendStringsToObj(Tcl_GetObjResult(interp),
+                                   cmdName, " varlist is empty", (char *) NULL);
+            result = TCL_ERROR;
+            goto done;
+        }
+        copyList[i*2] = ShareList(argObjv[1+i*2], c, v);
+        Tcl_IncrRefCount(copyList[i*2]);
+        (void) Tcl_ListObjGetElements(NULL, copyList[i*2], &varcList[i], &varvList[i]);
+
+        result = Tcl_ListObjGetElements(interp, argObjv[2+i*2], &c, &v);
+        if (result != TCL_OK) {
+            goto done;
+        }
+        copyList[i*2+1] = ShareList(argObjv[2+i*2], c, v);
+        Tcl_IncrRefCount(copyList[i*2+1]);
+        (void) Tcl_ListObjGetElements(NULL, copyList[i*2+1], &argcList[i], &argvList[i]);
+
+        j = argcList[i] / varcList[i];
+        if ((argcList[i] % varcList[i]) != 0) {
+            j++;
+        }
+        if (j > maxj) {
+            maxj = j;
+        }
+    }
+
+    /*
+     * At most maxj results are collected by "lmap", so have the list
+     * allocated at its final size instead of growing it on append.
+     */
+
+    if (collect) {
+        listPtr = Tcl_NewListObj(maxj, NULL);
+        Tcl_IncrRefCount(listPtr);
+    }
+
+    /*
+     * Iterate maxj times through the lists in parallel
+     * If some value lists run out of values, set loop vars to ""
+     */
+
+    bodyPtr = argObjv[objc-1];
+    for (j = 0;  j < maxj;  j++) {
+        for (i = 0;  i < numLists;  i++) {
+            /*
+             * The values are kept alive by the private lists, and the
+             * variable names are the same objects on every iteration,
+             * such that their cached variable lookup remains valid.
+             */
+
+            for (v = 0;  v < varcList[i];  v++) {
+                int k = index[i]++;
+                Tcl_Obj *valuePtr, *varValuePtr;
+
+                if (k < argcList[i]) {
+                    valuePtr = argvList[i][k];
+                } else {
+                    if (emptyPtr == NULL) {
+                        emptyPtr = Tcl_NewObj();
+                        Tcl_IncrRefCount(emptyPtr);
+                    }
+                    valuePtr = emptyPtr;
+                }
+                varValuePtr = Tcl_ObjSetVar2(interp, varvList[i][v],
+                                             NULL, valuePtr, 0);
+                if (varValuePtr == NULL) {
+                    Tcl_ResetResult(interp);
+                    Tcl_AppendStringsToObj(Tcl_GetObjResult(interp),
+                                           "couldn't set loop variable: \"",
+                                           Tcl_GetString(varvList[i][v]), "\"", (char *) NULL);
+                    result = TCL_ERROR;
+                    goto done;
+                }
+
+            }
+        }
+
+        result = CheckControl(interp, &data);
+
+        if (result == TCL_OK) {
+            result = Tcl_EvalObjEx(interp, bodyPtr, 0);
+            if (result == TCL_OK && collect) {
+                (void) Tcl_ListObjAppendElement(NULL, listPtr, Tcl_GetObjResult(interp));
+            }
+        }
+        if (result != TCL_OK) {
+            if (result == TCL_CONTINUE) {
+                result = TCL_OK;
+            } else if (result == TCL_BREAK) {
+                result = TCL_OK;
+                break;
+            } else if (result == TCL_ERROR) {
+                char msg[32 + TCL_INTEGER_SPACE];
+
+                sprintf(msg, "\n    (\"%s\" body line %d)",
+                        cmdName, Tcl_GetErrorLine(interp));
+                Tcl_AddObjErrorInfo(interp, msg, -1);
+                break;
+            } else {
+                break;
+            }
+        }
+    }
+    if (result == TCL_OK) {
+        if (collect) {
+            Tcl_SetObjResult(interp, listPtr);
+        } else {
+            Tcl_ResetResult(interp);
+        }
+    }
+
+ done:
+    if (listPtr != NULL) {
+        Tcl_DecrRefCount(listPtr);
+    }
+    for (i = 0;  i < numLists * 2;  i++) {
+        if (copyList[i] != NULL) {
+            Tcl_DecrRefCount(copyList[i]);
+        }
+    }
+    if (emptyPtr != NULL) {
+        Tcl_DecrRefCount(emptyPtr);
+    }
+    if (numLists > STATIC_LIST_SIZE) {
+        ArenaFree(threadPtr, index);
+        ArenaFree(threadPtr, varcList);
+        ArenaFree(threadPtr, argcList);
+        ArenaFree(threadPtr, varvList);
+        ArenaFree(threadPtr, argvList);
+        ArenaFree(threadPtr, copyList);
+    }
+    LeaveLoop(&data);
+    if (argObjv != argObjStorage) {
+        ArenaFree(threadPtr, argObjv);
+    }
+
+    return result;
+
+#undef STATIC_LIST_SIZE
+#undef NUM_ARGS
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ShareList --
+ *
+ *      Return a new list with the elements of a list object, for the
+ *      private iteration of EachLoop. When the object is a list, the
+ *      new list shares its internal representation, like TclListObjCopy
+ *      does for the "foreach" of Tcl, so this takes constant time. The
+ *      element array is then only copied when either list is modified.
+ *
+ * Results:
+ *      A new list object with a refcount of 0.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static Tcl_Obj *
+ShareList(Tcl_Obj *listPtr, TCL_SIZE_T objc, Tcl_Obj *const objv[])
+{
+    Tcl_Obj *copyPtr;
+
+    if (listPtr->typePtr == listTypePtr && listTypePtr->dupIntRepProc != NULL) {
+        copyPtr = Tcl_NewObj();
+        Tcl_InvalidateStringRep(copyPtr);
+        listTypePtr->dupIntRepProc(listPtr, copyPtr);
+    } else {
+        copyPtr = Tcl_NewListObj(objc, objv);
+    }
+
+    return copyPtr;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DictForObjCmd --
+ *
+ *      This object-based procedure is invoked to process the "dict for"
+ *      Tcl command.  See the user documentation for details on what it
+ *      does.
+ *
+ * Results:
+ *      A standard Tcl object result.
+ *
+ * Side effects:
+ *      See the user documentation.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+DictForObjCmd(ClientData clientData, Tcl_Interp *interp, TCL_SIZE_T objc, Tcl_Obj *const objv[])
+{
+    LoopData        data;
+    Tcl_DictSearch  search;
+    Tcl_Obj        *argObjv[4], *varPtr[2], **varv, *keyPtr, *valuePtr;
+    TCL_SIZE_T      varc;
+    int             result, done, i;
+
+    if (objc != 4) {
+        Tcl_WrongNumArgs(interp, 1, objv, "{keyVarName valueVarName} dictionary script");
+        return TCL_ERROR;
+    }
+    if (Tcl_ListObjGetElements(interp, objv[1], &varc, &varv) != TCL_OK) {
+        return TCL_ERROR;
+    }
+    if (varc != 2) {
+        Tcl_SetObjResult(interp, Tcl_NewStringObj("must have exactly two variable names", -1));
+        Tcl_SetErrorCode(interp, "TCL", "SYNTAX", "dict", "for", (char *) NULL);
+        return TCL_ERROR;
+    }
+
+    /*
+     * Pin the args and the variable names, see ForeachObjCmd. Holding
+     * a reference to the dictionary also forces any change to it by
+     * the body to work on a copy, so the search stays valid.
+     */
+
+    for (i = 0; i < 4; i++) {
+        argObjv[i] = objv[i];
+        Tcl_IncrRefCount(argObjv[i]);
+    }
+    for (i = 0; i < 2; i++) {
+        varPtr[i] = varv[i];
+        Tcl_IncrRefCount(varPtr[i]);
+    }
+    EnterLoop(clientData, interp, &data, objc, argObjv);
+
+    result = Tcl_DictObjFirst(interp, argObjv[2], &search, &keyPtr, &valuePtr, &done);
+    if (result != TCL_OK) {
+        goto done;
+    }
+    while (!done) {
+        if (Tcl_ObjSetVar2(interp, varPtr[0], NULL, keyPtr, TCL_LEAVE_ERR_MSG) == NULL
+            || Tcl_ObjSetVar2(interp, varPtr[1], NULL, valuePtr, TCL_LEAVE_ERR_MSG) == NULL) {
+            result = TCL_ERROR;
+            break;
+        }
+        result = CheckControl(interp, &data);
+        if (result == TCL_OK) {
+            result = Tcl_EvalObjEx(interp, argObjv[3], 0);
+        }
+        if (result != TCL_OK) {
+            if (result == TCL_CONTINUE) {
+                result = TCL_OK;
+            } else if (result == TCL_BREAK) {
+                result = TCL_OK;
+                break;
+            } else {
+                if (result == TCL_ERROR) {
+                    char msg[32 + TCL_INTEGER_SPACE];
+
+                    sprintf(msg, "\n    (\"dict for\" body line %d)", Tcl_GetErrorLine(interp));
+                    Tcl_AddErrorInfo(interp, msg);
+                }
+                break;
+            }
+        }
+        Tcl_DictObjNext(&search, &keyPtr, &valuePtr, &done);
+    }
+    Tcl_DictObjDone(&search);
+    if (result == TCL_OK) {
+        Tcl_ResetResult(interp);
+    }
+
+ done:
+    LeaveLoop(&data);
+    for (i = 0; i < 2; i++) {
+        Tcl_DecrRefCount(varPtr[i]);
+    }
+    for (i = 0; i < 4; i++) {
+        Tcl_DecrRefCount(argObjv[i]);
+    }
+
+    return result;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * EnterLoop --
+ *
+ *      Initialize the LoopData structure when a "for" or "while"
+ *      command starts. The loop is registered right away, or, when
+ *      "registerafter" is configured, from CheckControl once it has
+ *      completed that many iterations.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Loop can be monitored and possibly canceled by "loopctl_*".
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+EnterLoop(const ServerData *serverPtr, Tcl_Interp *interp, LoopData *loopPtr,
+          TCL_SIZE_T objc, Tcl_Obj * const objv[])
+{
+    loopPtr->control = LOOP_RUN;
+    loopPtr->attention = 0;
+    loopPtr->cancelSent = NS_FALSE;
+    loopPtr->abortSent = NS_FALSE;
+    loopPtr->controlUntil.sec = 0;
+    loopPtr->controlUntil.usec = 0;
+    loopPtr->active.rate = 0;
+    loopPtr->active.duty = 0;
+    loopPtr->activeUntil.sec = 0;
+    loopPtr->activeUntil.usec = 0;
+    loopPtr->interp = interp;
+    loopPtr->spins = 0;
+    loopPtr->evalPtr = NULL;
+    loopPtr->hPtr = NULL;
+    loopPtr->shardPtr = NULL;
+    loopPtr->serverPtr = serverPtr;
+    loopPtr->threadPtr = GetThreadData();
+    loopPtr->objc = objc;
+    loopPtr->objv = objv;
+    loopPtr->budgetChanged = NS_FALSE;
+    loopPtr->granularity = serverPtr->checkEvery;
+    loopPtr->pollEvery = serverPtr->checkEvery > 0u ? serverPtr->checkEvery : 1u;
+    loopPtr->nextPoll = 0u;
+    loopPtr->granularityChanged = NS_FALSE;
+    Ns_GetTime(&loopPtr->etime);
+    CountEvent(COUNT_LOOPS);
+    SetBudget(loopPtr, &serverPtr->budget);
+
+    if (serverPtr->registerAfter == 0u) {
+        RegisterLoop(loopPtr);
+    }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RegisterLoop --
+ *
+ *      Add entry for the LoopData structure to the loops table of the
+ *      shard of the current thread. Unless "fullargs" is configured,
+ *      only a bounded prefix of each argument is captured for
+ *      loopctl_info.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Loop can be monitored and possibly canceled by "loopctl_*".
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+RegisterLoop(LoopData *loopPtr)
+{
+    ThreadData       *threadPtr;
+    Shard            *shardPtr;
+
+    loopPtr->tid = Ns_ThreadId();
+    loopPtr->samples[0].time = loopPtr->etime;
+    loopPtr->samples[0].spins = 0u;
+    loopPtr->nsamples = 1u;
+    loopPtr->stride = LOOPCTL_CLOCK_SPINS;
+    loopPtr->nextSample = loopPtr->spins + loopPtr->stride;
+
+    /* NB: Must copy strings in case loop body updates or invalidates them. */
+
+    threadPtr = loopPtr->threadPtr;
+    ArenaInitString(threadPtr, &loopPtr->args);
+    AppendArgs(&loopPtr->args, loopPtr->serverPtr, loopPtr->objc, loopPtr->objv);
+
+    shardPtr = threadPtr->shardPtr;
+    loopPtr->shardPtr = shardPtr;
+    if (loopPtr->spins == 0u) {
+        loopPtr->wallStart = loopPtr->etime;
+    } else {
+        Ns_GetTime(&loopPtr->wallStart);
+    }
+    GetCpuTime(threadPtr, &loopPtr->cpuStart);
+    loopPtr->cpu.sec = 0;
+    loopPtr->cpu.usec = 0;
+    loopPtr->monSpins = loopPtr->spins;
+    loopPtr->monTime = loopPtr->wallStart;
+    loopPtr->monProgress = loopPtr->wallStart;
+    loopPtr->monFlags = 0u;
+
+    Ns_MutexLock(&shardPtr->lock);
+    loopPtr->hPtr = NewEntry(shardPtr, &shardPtr->loops, &loopPtr->lid);
+    Tcl_SetHashValue(loopPtr->hPtr, loopPtr);
+    loopPtr->parentPtr = threadPtr->loopPtr;
+    if (loopPtr->parentPtr == NULL) {
+        loopPtr->depth = 1u;
+        threadPtr->outerPtr = loopPtr;
+    } else {
+        loopPtr->depth = loopPtr->parentPtr->depth + 1u;
+    }
+    threadPtr->loopPtr = loopPtr;
+    if (threadPtr->cancelDepth != 0u) {
+        LOOPCTL_STORE(&loopPtr->attention, 1);
+    }
+    if (loopPtr->serverPtr->eventLoops) {
+        LogEvent(EVENT_ENTER, loopPtr);
+    }
+    Ns_MutexUnlock(&shardPtr->lock);
+
+    loopPtr->nextCheck = NextCheck(loopPtr);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * SetBudget --
+ *
+ *      Set the spin and time budget of a loop, and compute the spins
+ *      at which CheckControl has to leave its fast path next.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+SetBudget(LoopData *loopPtr, const Budget *budgetPtr)
+{
+    loopPtr->budget = *budgetPtr;
+    loopPtr->deadline = loopPtr->etime;
+    Ns_IncrTime(&loopPtr->deadline, budgetPtr->time.sec, budgetPtr->time.usec);
+    loopPtr->nextCheck = NextCheck(loopPtr);
+}
+
+static uint64_t
+NextCheck(const LoopData *loopPtr)
+{
+    uint64_t next;
+
+    if (loopPtr->hPtr == NULL) {
+        next = loopPtr->serverPtr->registerAfter;
+    } else {
+        next = loopPtr->nextSample;
+    }
+    if ((loopPtr->budget.time.sec > 0 || loopPtr->budget.time.usec > 0)
+        && loopPtr->spins + LOOPCTL_CLOCK_SPINS < next) {
+        next = loopPtr->spins + LOOPCTL_CLOCK_SPINS;
+    }
+    if (loopPtr->budget.spins > 0u && loopPtr->budget.spins < next) {
+        next = loopPtr->budget.spins + 1u;
+    }
+    if (loopPtr->active.rate > 0 || loopPtr->active.duty > 0) {
+        next = loopPtr->spins + 1u;
+    }
+
+    return next;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * CheckBudget --
+ *
+ *      Cancel the loop when it has exhausted its spin or time budget.
+ *      The clock is only read every LOOPCTL_CLOCK_SPINS spins, or
+ *      when the next rate sample is due. Throttled loops are delayed
+ *      here on every spin.
+ *
+ * Results:
+ *      TCL_OK if the budget is not exceeded, TCL_ERROR otherwise.
+ *
+ * Side effects:
+ *      Leave budget message and error code NSLOOPCTL BUDGET SPINS or
+ *      NSLOOPCTL BUDGET TIME in interp.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+CheckBudget(Tcl_Interp *interp, LoopData *loopPtr)
+{
+    Ns_Time now;
+    bool    haveTime = NS_FALSE;
+
+    if (loopPtr->spins < loopPtr->nextCheck) {
+        return TCL_OK;
+    }
+    if (loopPtr->hPtr != NULL && loopPtr->spins >= loopPtr->nextSample) {
+        Ns_GetTime(&now);
+        haveTime = NS_TRUE;
+        TakeSample(loopPtr, &now);
+    }
+    if (loopPtr->budget.spins > 0u && loopPtr->spins > loopPtr->budget.spins) {
+        Tcl_SetObjResult(interp, Tcl_NewStringObj(
+                             "nsloopctl: loop spin budget exceeded: returning TCL_ERROR", -1));
+        Tcl_SetErrorCode(interp, "NSLOOPCTL", "BUDGET", "SPINS", NULL);
+        CountEvent(COUNT_BUDGETS);
+        return TCL_ERROR;
+    }
+    if (loopPtr->budget.time.sec > 0 || loopPtr->budget.time.usec > 0) {
+        if (!haveTime) {
+            Ns_GetTime(&now);
+        }
+        if (Ns_DiffTime(&loopPtr->deadline, &now, NULL) < 0) {
+            Tcl_SetObjResult(interp, Tcl_NewStringObj(
+                                 "nsloopctl: loop time budget exceeded: returning TCL_ERROR", -1));
+            Tcl_SetErrorCode(interp, "NSLOOPCTL", "BUDGET", "TIME", NULL);
+            CountEvent(COUNT_BUDGETS);
+            return TCL_ERROR;
+        }
+    }
+    if (loopPtr->active.rate > 0 || loopPtr->active.duty > 0) {
+        ThrottleLoop(loopPtr);
+    }
+    loopPtr->nextCheck = NextCheck(loopPtr);
+
+    return TCL_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ThrottleLoop --
+ *
+ *      Delay a throttled loop, such that it does not exceed its max
+ *      spin rate, enforced by a token bucket allowing bursts of 100ms,
+ *      and does not run more than its duty cycle.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Blocks for the delay or until a control request arrives. The
+ *      throttle ends when its timeout has expired, checked on every
+ *      spin even if no delay is needed.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+ThrottleLoop(LoopData *loopPtr)
+{
+    const Throttle *throttlePtr = &loopPtr->active;
+    Shard          *shardPtr = loopPtr->shardPtr;
+    Ns_Time         now, diff, until;
+    double          elapsed, delay = 0.0, burst;
+
+    Ns_GetTime(&now);
+    if ((loopPtr->activeUntil.sec > 0 || loopPtr->activeUntil.usec > 0)
+        && Ns_DiffTime(&loopPtr->activeUntil, &now, NULL) <= 0) {
+        Ns_MutexLock(&shardPtr->lock);
+        if (loopPtr->control == LOOP_THROTTLE && ControlExpired(loopPtr, &now)) {
+            LOOPCTL_STORE(&loopPtr->attention, 1);
+        }
+        Ns_MutexUnlock(&shardPtr->lock);
+        loopPtr->activeUntil.sec = 0;
+        loopPtr->activeUntil.usec = 0;
+        return;
+    }
+    (void) Ns_DiffTime(&now, &loopPtr->lastSpin, &diff);
+    elapsed = (double)diff.sec + (double)diff.usec / 1000000.0;
+    loopPtr->lastSpin = now;
+
+    if (throttlePtr->rate > 0) {
+        burst = (double)throttlePtr->rate / 10.0;
+        if (burst < 1.0) {
+            burst = 1.0;
+        }
+        loopPtr->tokens += elapsed * (double)throttlePtr->rate;
+        if (loopPtr->tokens > burst) {
+            loopPtr->tokens = burst;
+        }
+        loopPtr->tokens -= 1.0;
+        if (loopPtr->tokens < 0.0) {
+            delay = -loopPtr->tokens / (double)throttlePtr->rate;
+        }
+    }
+    if (throttlePtr->duty > 0 && throttlePtr->duty < 100) {
+        double wait = elapsed * (double)(100 - throttlePtr->duty) / (double)throttlePtr->duty;
+
+        if (wait > delay) {
+            delay = wait;
+        }
+    }
+    if (delay <= 0.0) {
+        return;
+    }
+
+    until = now;
+    Ns_IncrTime(&until, (time_t)delay, (long)((delay - (double)(time_t)delay) * 1000000.0));
+    if ((loopPtr->activeUntil.sec > 0 || loopPtr->activeUntil.usec > 0)
+        && Ns_DiffTime(&loopPtr->activeUntil, &until, NULL) < 0) {
+        until = loopPtr->activeUntil;
+    }
+    Ns_MutexLock(&shardPtr->lock);
+    if (LOOPCTL_LOAD(&loopPtr->attention) == 0) {
+        (void) Ns_CondTimedWait(&loopPtr->threadPtr->cond, &shardPtr->lock, &until);
+    }
+    Ns_MutexUnlock(&shardPtr->lock);
+
+    if (throttlePtr->rate > 0) {
+        loopPtr->tokens += delay * (double)throttlePtr->rate;
+    }
+    loopPtr->lastSpin = until;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TakeSample --
+ *
+ *      Add the current spins to the rate history of the loop and
+ *      adapt the sample stride, such that the clock is read at most
+ *      a few times per second for fast loops. An adaptive granularity
+ *      is derived from the time per spin since the last sample.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+TakeSample(LoopData *loopPtr, const Ns_Time *nowPtr)
+{
+    const Sample *lastPtr;
+    Sample       *samplePtr;
+    Ns_Time       diff, cpu;
+
+    lastPtr = &loopPtr->samples[(loopPtr->nsamples - 1u) % LOOPCTL_SAMPLES];
+    (void) Ns_DiffTime(nowPtr, &lastPtr->time, &diff);
+    GetCpuTime(loopPtr->threadPtr, &cpu);
+
+    Ns_MutexLock(&loopPtr->shardPtr->lock);
+    samplePtr = &loopPtr->samples[loopPtr->nsamples % LOOPCTL_SAMPLES];
+    samplePtr->time = *nowPtr;
+    samplePtr->spins = loopPtr->spins;
+    loopPtr->nsamples++;
+    (void) Ns_DiffTime(&cpu, &loopPtr->cpuStart, &loopPtr->cpu);
+    Ns_MutexUnlock(&loopPtr->shardPtr->lock);
+
+    if (loopPtr->granularity == 0u && samplePtr->spins > lastPtr->spins) {
+        double usec = ((double)diff.sec * 1000000.0 + (double)diff.usec)
+            / (double)(samplePtr->spins - lastPtr->spins);
+
+        loopPtr->pollEvery = usec * (double)LOOPCTL_GRANULARITY_MAX > LOOPCTL_POLL_USEC
+            ? (unsigned int)(LOOPCTL_POLL_USEC / usec) + 1u : LOOPCTL_GRANULARITY_MAX;
+    }
+    if (diff.sec == 0 && diff.usec < 100000 && loopPtr->stride < LOOPCTL_STRIDE_MAX) {
+        loopPtr->stride <<= 1;
+    } else if (diff.sec >= 1 && loopPtr->stride > 1u) {
+        loopPtr->stride >>= 1;
+    }
+    loopPtr->nextSample = loopPtr->spins + loopPtr->stride;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * AppendRate --
+ *
+ *      Append the recent spin rate, the time per iteration and the
+ *      sample history of the loop in array-get format. The rate is
+ *      computed from the oldest sample in the history up to now, so
+ *      a loop waiting in the body slows down immediately. Must be
+ *      called with the shard of the loop locked.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+AppendRate(Tcl_DString *dsPtr, const LoopData *loopPtr, const Ns_Time *nowPtr)
+{
+    const Sample *samplePtr;
+    Ns_Time       diff;
+    unsigned int  i, first;
+    double        secs, rate = 0.0, itertime = 0.0;
+    char          buf[TCL_DOUBLE_SPACE + TCL_INTEGER_SPACE * 2];
+
+    first = loopPtr->nsamples > LOOPCTL_SAMPLES ? loopPtr->nsamples - LOOPCTL_SAMPLES : 0u;
+    samplePtr = &loopPtr->samples[first % LOOPCTL_SAMPLES];
+    (void) Ns_DiffTime(nowPtr, &samplePtr->time, &diff);
+    secs = (double)diff.sec + (double)diff.usec / 1000000.0;
+    if (secs > 0.0) {
+        rate = (double)(LOOPCTL_LOAD64(&loopPtr->spins) - samplePtr->spins) / secs;
+    }
+    if (rate > 0.0) {
+        itertime = 1.0 / rate;
+    }
+    snprintf(buf, sizeof(buf), "rate %.2f itertime %.6f", rate, itertime);
+    Tcl_DStringAppend(dsPtr, buf, -1);
+
+    Tcl_DStringAppend(dsPtr, " history", 8);
+    Tcl_DStringStartSublist(dsPtr);
+    for (i = first; i < loopPtr->nsamples; i++) {
+        samplePtr = &loopPtr->samples[i % LOOPCTL_SAMPLES];
+        snprintf(buf, sizeof(buf), NS_TIME_FMT " %" PRIu64,
+                 (int64_t) samplePtr->time.sec, samplePtr->time.usec, samplePtr->spins);
+        Tcl_DStringAppendElement(dsPtr, buf);
+    }
+    Tcl_DStringEndSublist(dsPtr);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * AppendArg --
+ *
+ *      Append at most size bytes of a command argument as a list
+ *      element. The string representation is never generated for
+ *      values which might be large: the elements of pure lists are
+ *      summarized up to the limit, other values are represented by
+ *      their type name. Loop args cannot be rendered later on demand,
+ *      since loopctl_info runs in a different thread than the loop
+ *      owning the Tcl_Objs.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      String representation of scalar values might be generated.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+AppendArg(Tcl_DString *dsPtr, Tcl_Obj *objPtr, TCL_SIZE_T size, bool nested)
+{
+    Tcl_DString ds;
+    Tcl_Obj   **objv;
+    TCL_SIZE_T  objc, i, length;
+    const char *bytes;
+    bool        scalar = NS_FALSE;
+
+    for (i = 0; i < (TCL_SIZE_T)(sizeof(scalarTypes) / sizeof(scalarTypes[0])); i++) {
+        if (objPtr->typePtr != NULL && objPtr->typePtr == scalarTypes[i]) {
+            scalar = NS_TRUE;
+            break;
+        }
+    }
+
+    Tcl_DStringInit(&ds);
+    if (objPtr->bytes != NULL || scalar) {
+        bytes = Tcl_GetStringFromObj(objPtr, &length);
+        Tcl_DStringAppend(&ds, bytes, length > size ? size + 1 : length);
+
+    } else if (!nested && objPtr->typePtr == listTypePtr
+               && Tcl_ListObjGetElements(NULL, objPtr, &objc, &objv) == TCL_OK) {
+        for (i = 0; i < objc && Tcl_DStringLength(&ds) <= size; i++) {
+            AppendArg(&ds, objv[i], size - Tcl_DStringLength(&ds), NS_TRUE);
+        }
+
+    } else {
+        Tcl_DStringAppend(&ds, "<", 1);
+        Tcl_DStringAppend(&ds, objPtr->typePtr != NULL ? objPtr->typePtr->name : "value", -1);
+        Tcl_DStringAppend(&ds, ">", 1);
+    }
+
+    if (Tcl_DStringLength(&ds) > size) {
+        /*
+         * Truncate, but do not cut a multi-byte UTF-8 character apart.
+         */
+
+        length = size;
+        while (length > 0 && (UCHAR(ds.string[length]) & 0xC0u) == 0x80u) {
+            length--;
+        }
+        Tcl_DStringSetLength(&ds, length);
+        Tcl_DStringAppend(&ds, "...", 3);
+    }
+    Tcl_DStringAppendElement(dsPtr, Tcl_DStringValue(&ds));
+    Tcl_DStringFree(&ds);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LeaveLoop --
+ *
+ *      Remove entry for the LoopData structure when a "for" or
+ *      "while" command exits.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+LeaveLoop(LoopData *loopPtr)
+{
+    Shard      *shardPtr;
+    ThreadData *threadPtr = loopPtr->threadPtr;
+    EvalData   *evalPtr;
+
+    if (loopPtr->serverPtr->profile || loopPtr->serverPtr->histograms) {
+        Ns_Time     now, diff;
+        uint64_t    usec;
+
+        Ns_GetTime(&now);
+        (void) Ns_DiffTime(&now, &loopPtr->etime, &diff);
+        usec = (diff.sec < 0) ? 0u : (uint64_t)diff.sec * 1000000u + (uint64_t)diff.usec;
+        if (loopPtr->serverPtr->histograms) {
+            RecordLoop(loopPtr, threadPtr, usec);
+        }
+        if (loopPtr->serverPtr->profile) {
+            ProfileLoop(loopPtr, threadPtr, usec);
+        }
+    }
+    if (loopPtr->hPtr == NULL) {
+        return;
+    }
+    shardPtr = loopPtr->shardPtr;
+    Ns_MutexLock(&shardPtr->lock);
+    while ((evalPtr = loopPtr->evalPtr) != NULL) {
+        loopPtr->evalPtr = evalPtr->nextPtr;
+        evalPtr->state = EVAL_DROP;
+        Ns_GetTime(&evalPtr->doneTime);
+        CountEvent(COUNT_EVAL_DROPS);
+        LogEvent(EVENT_EVAL_DROP, loopPtr);
+        Ns_CondBroadcast(&evalPtr->cond);
+        ReleaseEval(evalPtr);
+    }
+    if (loopPtr->abortSent) {
+        Ns_GetTime(&threadPtr->abortAck);
+        Ns_Log(Warning, "nsloopctl: loop %" PRIxPTR " aborted", loopPtr->lid);
+        CountEvent(COUNT_ABORTS);
+        LogEvent(EVENT_ABORT, loopPtr);
+    }
+    if (loopPtr->serverPtr->eventLoops) {
+        LogEvent(EVENT_LEAVE, loopPtr);
+    }
+    Tcl_DeleteHashEntry(loopPtr->hPtr);
+    if (threadPtr->loopPtr == loopPtr) {
+        threadPtr->loopPtr = loopPtr->parentPtr;
+        if (threadPtr->outerPtr == loopPtr) {
+            threadPtr->outerPtr = NULL;
+        }
+    } else {
+        LoopData *childPtr = threadPtr->loopPtr;
+
+        childPtr->depth--;
+        while (childPtr->parentPtr != loopPtr) {
+            childPtr = childPtr->parentPtr;
+            childPtr->depth--;
+        }
+        childPtr->parentPtr = loopPtr->parentPtr;
+        if (threadPtr->outerPtr == loopPtr) {
+            threadPtr->outerPtr = childPtr;
+        }
+    }
+    if (loopPtr->depth <= threadPtr->cancelDepth) {
+        threadPtr->cancelDepth = 0u;
+    }
+    Ns_MutexUnlock(&shardPtr->lock);
+    ArenaFreeString(threadPtr, &loopPtr->args);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * AppendArgs --
+ *
+ *      Append the args of a loop command as a list. Unless "fullargs"
+ *      is configured, only a bounded prefix of each argument is
+ *      captured.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      See AppendArg.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+AppendArgs(Tcl_DString *dsPtr, const ServerData *serverPtr, TCL_SIZE_T objc, Tcl_Obj *const objv[])
+{
+    TCL_SIZE_T i;
+
+    for (i = 0; i < objc; ++i) {
+        if (serverPtr->fullArgs) {
+            Tcl_DStringAppendElement(dsPtr, Tcl_GetString(objv[i]));
+        } else {
+            AppendArg(dsPtr, objv[i], serverPtr->argSize, NS_FALSE);
+        }
+    }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ProfileLoop --
+ *
+ *      Add a finished loop to the profile of its call site in the
+ *      current thread. The call site is identified by a hash of the
+ *      loop command and body, such that the same loop in a proc is
+ *      aggregated over all its invocations. The hash is computed once
+ *      per body object, see BodyKey. Only the insert of a new site
+ *      takes the lock of the shard.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Call site might be added to the profile of the thread.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+ProfileLoop(const LoopData *loopPtr, ThreadData *threadPtr, uint64_t usec)
+{
+    Shard         *shardPtr = threadPtr->shardPtr;
+    Tcl_HashEntry *hPtr, *bodyPtr;
+    Site          *sitePtr;
+    BodyKey        body;
+    const char    *p, *end;
+    TCL_SIZE_T     len;
+    uint64_t       key = UINT64_C(0xcbf29ce484222325);
+    unsigned int   epoch, b;
+    int            new;
+
+    /*
+     * Only this thread modifies its tables, so the lookups need no lock.
+     */
+
+    epoch = LOOPCTL_LOAD(&threadPtr->profileEpoch);
+    body.cmdPtr = loopPtr->objv[0];
+    body.bodyPtr = loopPtr->objv[loopPtr->objc - 1];
+    bodyPtr = Tcl_FindHashEntry(&threadPtr->bodies, (const char *)&body);
+    if (bodyPtr != NULL) {
+        sitePtr = Tcl_GetHashValue(bodyPtr);
+        hPtr = NULL;
+    } else {
+
+        /*
+         * FNV-1a of the command name and the body, which is always the
+         * last argument.
+         */
+
+        p = Tcl_GetStringFromObj(body.cmdPtr, &len);
+        for (end = p + len; p < end; p++) {
+            key = (key ^ (unsigned char)*p) * UINT64_C(0x100000001b3);
+        }
+        p = Tcl_GetStringFromObj(body.bodyPtr, &len);
+        for (end = p + len; p < end; p++) {
+            key = (key ^ (unsigned char)*p) * UINT64_C(0x100000001b3);
+        }
+        hPtr = Tcl_FindHashEntry(&threadPtr->sites, (const char *)&key);
+        sitePtr = (hPtr != NULL) ? Tcl_GetHashValue(hPtr) : NULL;
+    }
+    if (sitePtr == NULL) {
+        Tcl_DString ds;
+
+        Tcl_DStringInit(&ds);
+        if (loopPtr->hPtr != NULL) {
+            Tcl_DStringAppend(&ds, loopPtr->args.string, loopPtr->args.length);
+        } else {
+            AppendArgs(&ds, loopPtr->serverPtr, loopPtr->objc, loopPtr->objv);
+        }
+        sitePtr = ns_calloc(1u, sizeof(Site));
+        sitePtr->label = ns_strdup(ds.string);
+        sitePtr->epoch = epoch;
+        Tcl_DStringFree(&ds);
+
+        Ns_MutexLock(&shardPtr->lock);
+        hPtr = Tcl_CreateHashEntry(&threadPtr->sites, (const char *)&key, &new);
+        Tcl_SetHashValue(hPtr, sitePtr);
+        Ns_MutexUnlock(&shardPtr->lock);
+    } else if (sitePtr->epoch != epoch) {
+        LOOPCTL_STORE64(&sitePtr->count, 0u);
+        LOOPCTL_STORE64(&sitePtr->spins, 0u);
+        LOOPCTL_STORE64(&sitePtr->usec, 0u);
+        LOOPCTL_STORE64(&sitePtr->maxUsec, 0u);
+        for (b = 0u; b < LOOPCTL_BUCKETS; b++) {
+            LOOPCTL_STORE64(&sitePtr->hist[b], 0u);
+        }
+        LOOPCTL_STORE(&sitePtr->epoch, epoch);
+    }
+
+    /*
+     * Cache the site for the body, the sites of a thread are only freed
+     * when it exits.
+     */
+
+    if (bodyPtr == NULL) {
+        if (threadPtr->bodies.numEntries >= LOOPCTL_BODIES) {
+            FlushBodies(&threadPtr->bodies);
+        }
+        bodyPtr = Tcl_CreateHashEntry(&threadPtr->bodies, (const char *)&body, &new);
+        Tcl_IncrRefCount(body.cmdPtr);
+        Tcl_IncrRefCount(body.bodyPtr);
+        Tcl_SetHashValue(bodyPtr, sitePtr);
+    }
+    LOOPCTL_STORE64(&sitePtr->count, sitePtr->count + 1u);
+    LOOPCTL_STORE64(&sitePtr->spins, sitePtr->spins + loopPtr->spins);
+    LOOPCTL_STORE64(&sitePtr->usec, sitePtr->usec + usec);
+    if (usec > sitePtr->maxUsec) {
+        LOOPCTL_STORE64(&sitePtr->maxUsec, usec);
+    }
+    b = Log2Bucket(usec);
+    LOOPCTL_STORE64(&sitePtr->hist[b], sitePtr->hist[b] + 1u);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RecordLoop --
+ *
+ *      Count a finished loop in the histograms of its virtual server
+ *      in the current thread.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Histograms for the server might be added to the thread.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+RecordLoop(const LoopData *loopPtr, ThreadData *threadPtr, uint64_t usec)
+{
+    Histogram   *histPtr;
+    unsigned int b;
+
+    for (histPtr = threadPtr->histPtr; histPtr != NULL; histPtr = histPtr->nextPtr) {
+        if (histPtr->serverPtr == loopPtr->serverPtr) {
+            break;
+        }
+    }
+    if (histPtr == NULL) {
+        histPtr = ns_calloc(1u, sizeof(Histogram));
+        histPtr->serverPtr = loopPtr->serverPtr;
+        Ns_MutexLock(&threadPtr->shardPtr->lock);
+        histPtr->nextPtr = threadPtr->histPtr;
+        threadPtr->histPtr = histPtr;
+        Ns_MutexUnlock(&threadPtr->shardPtr->lock);
+    }
+
+    b = Log2Bucket(usec);
+    LOOPCTL_STORE64(&histPtr->duration[b], histPtr->duration[b] + 1u);
+    if (loopPtr->spins > 0u) {
+        b = Log2Bucket(usec * 1000u / loopPtr->spins);
+        LOOPCTL_STORE64(&histPtr->itertime[b], histPtr->itertime[b] + 1u);
+    }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * MergeHistograms --
+ *
+ *      Add histograms to the histograms of the same server in a list.
+ *      Must be called with the shard of the list locked.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Histograms might be added to the list.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+MergeHistograms(Histogram **histPtrPtr, const Histogram *fromPtr)
+{
+    Histogram   *histPtr;
+    unsigned int b;
+
+    for (histPtr = *histPtrPtr; histPtr != NULL; histPtr = histPtr->nextPtr) {
+        if (histPtr->serverPtr == fromPtr->serverPtr) {
+            break;
+        }
+    }
+    if (histPtr == NULL) {
+        histPtr = ns_calloc(1u, sizeof(Histogram));
+        histPtr->serverPtr = fromPtr->serverPtr;
+        histPtr->nextPtr = *histPtrPtr;
+        *histPtrPtr = histPtr;
+    }
+    for (b = 0u; b < LOOPCTL_BUCKETS; b++) {
+        histPtr->duration[b] += fromPtr->duration[b];
+        histPtr->itertime[b] += fromPtr->itertime[b];
+    }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * MergeSites --
+ *
+ *      Add the call site profiles of one table to another table. When
+ *      epochPtr is given, the source is the table of a thread, and its
+ *      sites of an older profile epoch are skipped. Must be called with
+ *      the shard of the source table locked.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Sites might be added to the target table.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+MergeSites(Tcl_HashTable *tablePtr, Tcl_HashTable *fromPtr, const unsigned int *epochPtr)
+{
+    Tcl_HashSearch search;
+    Tcl_HashEntry *hPtr, *toPtr;
+    const Site    *fromSitePtr;
+    Site          *sitePtr;
+    unsigned int   b;
+    int            new;
+
+    for (hPtr = Tcl_FirstHashEntry(fromPtr, &search); hPtr != NULL; hPtr = Tcl_NextHashEntry(&search)) {
+        fromSitePtr = Tcl_GetHashValue(hPtr);
+        if (epochPtr != NULL && LOOPCTL_LOAD(&fromSitePtr->epoch) != *epochPtr) {
+            continue;
+        }
+        toPtr = Tcl_CreateHashEntry(tablePtr, Tcl_GetHashKey(fromPtr, hPtr), &new);
+        if (new) {
+            sitePtr = ns_calloc(1u, sizeof(Site));
+            sitePtr->label = ns_strdup(fromSitePtr->label);
+            Tcl_SetHashValue(toPtr, sitePtr);
+        } else {
+            sitePtr = Tcl_GetHashValue(toPtr);
+        }
+        sitePtr->count += LOOPCTL_LOAD64(&fromSitePtr->count);
+        sitePtr->spins += LOOPCTL_LOAD64(&fromSitePtr->spins);
+        sitePtr->usec += LOOPCTL_LOAD64(&fromSitePtr->usec);
+        if (LOOPCTL_LOAD64(&fromSitePtr->maxUsec) > sitePtr->maxUsec) {
+            sitePtr->maxUsec = LOOPCTL_LOAD64(&fromSitePtr->maxUsec);
+        }
+        for (b = 0u; b < LOOPCTL_BUCKETS; b++) {
+            sitePtr->hist[b] += LOOPCTL_LOAD64(&fromSitePtr->hist[b]);
+        }
+    }
+}
+
+static void
+FreeSites(Tcl_HashTable *tablePtr)
+{
+    Tcl_HashSearch search;
+    Tcl_HashEntry *hPtr;
+
+    hPtr = Tcl_FirstHashEntry(tablePtr, &search);
+    while (hPtr != NULL) {
+        Site *sitePtr = Tcl_GetHashValue(hPtr);
+
+        ns_free(sitePtr->label);
+        ns_free(sitePtr);
+        hPtr = Tcl_NextHashEntry(&search);
+    }
+    Tcl_DeleteHashTable(tablePtr);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * FlushBodies --
+ *
+ *      Empty the cache of loop bodies of a thread.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      The references to the cached objects are released.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+FlushBodies(Tcl_HashTable *tablePtr)
+{
+    Tcl_HashSearch search;
+    Tcl_HashEntry *hPtr;
+
+    hPtr = Tcl_FirstHashEntry(tablePtr, &search);
+    while (hPtr != NULL) {
+        const BodyKey *keyPtr = (const BodyKey *)Tcl_GetHashKey(tablePtr, hPtr);
+
+        Tcl_DecrRefCount(keyPtr->cmdPtr);
+        Tcl_DecrRefCount(keyPtr->bodyPtr);
+        Tcl_DeleteHashEntry(hPtr);
+        hPtr = Tcl_NextHashEntry(&search);
+    }
+}
+
+static unsigned int
+Log2Bucket(uint64_t value)
+{
+    unsigned int b = 0u;
+
+    while (value > 0u && b < LOOPCTL_BUCKETS - 1u) {
+        value >>= 1;
+        b++;
+    }
+    return b;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * CheckControl --
+ *
+ *      Check for control flag within a loop of a cancel or pause.
+ *      The lock is only taken when the attention flag of the loop
+ *      signals a pending control command or eval request. The flag
+ *      is polled every "granularity" spins of the loop. Loops
+ *      which are not registered yet just count their spins until
+ *      the "registerafter" threshold is reached.
+ *
+ * Results:
+ *      TCL_OK if not canceled, TCL_ERROR otherwise.
+ *
+ * Side effects:
+ *      Leave cancel message as interp result.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+CheckControl(Tcl_Interp *interp, LoopData *loopPtr)
+{
+    Shard       *shardPtr;
+    ThreadData  *threadPtr;
+    EvalData    *evalPtr;
+    Tcl_Obj     *scriptObj;
+    Ns_Time      now;
+    char        *str;
+    int          result;
+    TCL_SIZE_T   len;
+
+    /*
+     * The monitor thread reads the spins concurrently, so the owning
+     * thread updates them with an atomic store.
+     */
+
+    LOOPCTL_STORE64(&loopPtr->spins, loopPtr->spins + 1u);
+    if (loopPtr->spins < loopPtr->nextCheck) {
+        if (loopPtr->spins < loopPtr->nextPoll) {
+            return TCL_OK;
+        }
+        loopPtr->nextPoll = loopPtr->spins + loopPtr->pollEvery;
+        if (LOOPCTL_LOAD(&loopPtr->attention) == 0) {
+            return TCL_OK;
+        }
+    }
+    if (loopPtr->hPtr == NULL && loopPtr->spins >= loopPtr->serverPtr->registerAfter) {
+        RegisterLoop(loopPtr);
+    }
+    if (LOOPCTL_LOAD(&loopPtr->attention) == 0) {
+        return CheckBudget(interp, loopPtr);
+    }
+
+    shardPtr = loopPtr->shardPtr;
+    threadPtr = loopPtr->threadPtr;
+    Ns_MutexLock(&shardPtr->lock);
+    while (loopPtr->evalPtr != NULL
+           || (loopPtr->control == LOOP_PAUSE && !Canceled(loopPtr) && !threadPtr->abort)) {
+        if ((evalPtr = loopPtr->evalPtr) != NULL) {
+            /*
+             * The script of a queued request is immutable, so it can
+             * be evaluated without holding the lock.
+             */
+
+            loopPtr->evalPtr = evalPtr->nextPtr;
+            evalPtr->state = EVAL_RUN;
+            Ns_MutexUnlock(&shardPtr->lock);
+            scriptObj = GetScript(interp, &evalPtr->script);
+            result = Tcl_EvalObjEx(interp, scriptObj, 0);
+            Tcl_DecrRefCount(scriptObj);
+            if (result != TCL_OK) {
+                Ns_TclLogErrorInfo(interp, "nsloopctl");
+            }
+            Ns_MutexLock(&shardPtr->lock);
+            if (evalPtr->refCount == 1) {
+                Ns_Log(Error, "nsloopctl: dropped result: %s", Tcl_GetStringResult(interp));
+            } else {
+                str = Tcl_GetStringFromObj(Tcl_GetObjResult(interp), &len);
+                Tcl_DStringAppend(&evalPtr->result, str, len);
+                evalPtr->code = result;
+            }
+            evalPtr->state = EVAL_DONE;
+            Ns_GetTime(&evalPtr->doneTime);
+            CountEvent(COUNT_EVALS);
+            LogEvent(EVENT_EVAL, loopPtr);
+            Ns_CondBroadcast(&evalPtr->cond);
+            ReleaseEval(evalPtr);
+        }
+        if (loopPtr->control == LOOP_PAUSE && !Canceled(loopPtr) && !threadPtr->abort) {
+            if (loopPtr->controlUntil.sec == 0 && loopPtr->controlUntil.usec == 0) {
+                Ns_CondWait(&threadPtr->cond, &shardPtr->lock);
+            } else {
+                (void) Ns_CondTimedWait(&threadPtr->cond, &shardPtr->lock,
+                                        &loopPtr->controlUntil);
+                Ns_GetTime(&now);
+                (void) ControlExpired(loopPtr, &now);
+            }
+        }
+    }
+    if (loopPtr->budgetChanged) {
+        SetBudget(loopPtr, &loopPtr->newBudget);
+        loopPtr->budgetChanged = NS_FALSE;
+    }
+    if (loopPtr->granularityChanged) {
+        loopPtr->granularity = loopPtr->newGranularity;
+        loopPtr->pollEvery = loopPtr->granularity > 0u ? loopPtr->granularity : 1u;
+        loopPtr->nextPoll = loopPtr->spins + loopPtr->pollEvery;
+        loopPtr->granularityChanged = NS_FALSE;
+    }
+    if (loopPtr->control == LOOP_THROTTLE) {
+        if (loopPtr->active.rate != loopPtr->throttle.rate
+            || loopPtr->active.duty != loopPtr->throttle.duty) {
+            loopPtr->active = loopPtr->throttle;
+            loopPtr->tokens = 1.0;
+            Ns_GetTime(&loopPtr->lastSpin);
+        }
+        loopPtr->activeUntil = loopPtr->controlUntil;
+    } else {
+        loopPtr->active.rate = 0;
+        loopPtr->active.duty = 0;
+    }
+    loopPtr->nextCheck = NextCheck(loopPtr);
+    if (threadPtr->abort) {
+        AckAbort(threadPtr);
+        Tcl_SetObjResult(interp, Tcl_NewStringObj("nsloopctl: async thread abort: returning TCL_ERROR", -1));
+        result = TCL_ERROR;
+    } else if (Canceled(loopPtr)) {
+        Tcl_SetObjResult(interp, Tcl_NewStringObj("nsloopctl: loop canceled: returning TCL_ERROR", -1));
+        result = TCL_ERROR;
+    } else {
+        LOOPCTL_STORE(&loopPtr->attention, 0);
+        result = TCL_OK;
+    }
+    Ns_MutexUnlock(&shardPtr->lock);
+
+    if (result == TCL_OK) {
+        result = CheckBudget(interp, loopPtr);
+    }
+
+    return result;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LimitHandler --
+ *
+ *      Command limit handler of the limit engine, called by Tcl once
+ *      "limitcommands" commands have been evaluated in the interp.
+ *      Re-arms the limit and handles pending pause, cancel and abort
+ *      requests for the loops of the thread. These requests thus
+ *      land within a bounded number of commands, regardless of how
+ *      long a single loop iteration takes.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Blocks while a loop of the thread is paused. Canceled loops
+ *      and aborts are reported by canceling the script evaluation in
+ *      the interp via Tcl_CancelEval (Tcl 8.6 and newer).
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+LimitHandler(ClientData clientData, Tcl_Interp *interp)
+{
+    const ServerData *serverPtr = clientData;
+    ThreadData       *threadPtr;
+    Shard            *shardPtr;
+    LoopData         *loopPtr;
+    Tcl_WideInt       limit;
+    Ns_Time           now, until;
+    const Ns_Time    *untilPtr;
+    bool              paused;
+
+    limit = (Tcl_WideInt)Tcl_LimitGetCommands(interp) + serverPtr->limitCommands;
+    Tcl_LimitSetCommands(interp, (TCL_SIZE_T)(limit < TCL_SIZE_MAX ? limit : TCL_SIZE_MAX));
+
+    threadPtr = Ns_TlsGet(&tls);
+    if (threadPtr == NULL || LOOPCTL_LOAD(&threadPtr->attention) == 0) {
+        return;
+    }
+
+    shardPtr = threadPtr->shardPtr;
+    Ns_MutexLock(&shardPtr->lock);
+    do {
+        paused = NS_FALSE;
+        untilPtr = NULL;
+        Ns_GetTime(&now);
+        for (loopPtr = threadPtr->loopPtr; loopPtr != NULL; loopPtr = loopPtr->parentPtr) {
+            if (loopPtr->control == LOOP_PAUSE && !ControlExpired(loopPtr, &now)) {
+                paused = NS_TRUE;
+                if ((loopPtr->controlUntil.sec > 0 || loopPtr->controlUntil.usec > 0)
+                    && (untilPtr == NULL || Ns_DiffTime(&loopPtr->controlUntil, untilPtr, NULL) < 0)) {
+                    until = loopPtr->controlUntil;
+                    untilPtr = &until;
+                }
+            }
+        }
+        if (paused && !threadPtr->abort) {
+            if (untilPtr == NULL) {
+                Ns_CondWait(&threadPtr->cond, &shardPtr->lock);
+            } else {
+                (void) Ns_CondTimedWait(&threadPtr->cond, &shardPtr->lock, untilPtr);
+            }
+        }
+    } while (paused && !threadPtr->abort);
+
+#ifdef TCL_CANCEL_UNWIND
+    if (threadPtr->abort) {
+        AckAbort(threadPtr);
+        Tcl_CancelEval(interp, Tcl_NewStringObj(
+                           "nsloopctl: async thread abort: returning TCL_ERROR", -1),
+                       NULL, 0);
+    } else {
+        for (loopPtr = threadPtr->loopPtr; loopPtr != NULL; loopPtr = loopPtr->parentPtr) {
+            if (loopPtr->control == LOOP_CANCEL && !loopPtr->cancelSent) {
+                loopPtr->cancelSent = NS_TRUE;
+                Tcl_CancelEval(loopPtr->interp, Tcl_NewStringObj(
+                                   "nsloopctl: loop canceled: returning TCL_ERROR", -1),
+                               NULL, 0);
+                break;
+            }
+        }
+    }
+#endif
+    LOOPCTL_STORE(&threadPtr->attention, 0);
+    Ns_MutexUnlock(&shardPtr->lock);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * AckAbort --
+ *
+ *      Acknowledge a thread abort requested via the limit engine,
+ *      which is delivered by LimitHandler or CheckControl. Must be
+ *      called with the shard of the thread locked.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      The abort is logged and counted.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+AckAbort(ThreadData *threadPtr)
+{
+    threadPtr->abort = NS_FALSE;
+    Ns_GetTime(&threadPtr->abortAck);
+    Ns_Log(Warning, "nsloopctl: abort");
+    CountEvent(COUNT_ABORTS);
+    if (threadPtr->loopPtr != NULL) {
+        LogEvent(EVENT_ABORT, threadPtr->loopPtr);
+    }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * GetCmdCount --
+ *
+ *      Return the number of commands evaluated so far in the interp,
+ *      which is the base for the command limit of the limit engine.
+ *
+ * Results:
+ *      Value of "info cmdcount".
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static TCL_SIZE_T
+GetCmdCount(Tcl_Interp *interp)
+{
+    Tcl_InterpState state;
+    Tcl_WideInt     count = 0;
+
+    state = Tcl_SaveInterpState(interp, TCL_OK);
+    if (Tcl_EvalEx(interp, "::info cmdcount", -1, 0) == TCL_OK) {
+        (void) Tcl_GetWideIntFromObj(NULL, Tcl_GetObjResult(interp), &count);
+    }
+    (void) Tcl_RestoreInterpState(interp, state);
+
+    return (TCL_SIZE_T)count;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ThreadAbort --
+ *
+ *      Callback which aborts Tcl execution in which ever interp is
+ *      currently running in the given thread.
+ *
+ * Results:
+ *      Always TCL_ERROR.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+ThreadAbort(ClientData clientData, Tcl_Interp *interp, int UNUSED(code))
+{
+    ThreadData *threadPtr = clientData;
+
+    Ns_MutexLock(&threadPtr->shardPtr->lock);
+    Ns_GetTime(&threadPtr->abortAck);
+    if (threadPtr->loopPtr != NULL) {
+        LogEvent(EVENT_ABORT, threadPtr->loopPtr);
+    }
+    Ns_MutexUnlock(&threadPtr->shardPtr->lock);
+
+    if (interp != NULL) {
+        Tcl_ResetResult(interp);
+        Tcl_SetObjResult(interp, Tcl_NewStringObj("nsloopctl: async thread abort: returning TCL_ERROR", -1));
+    } else {
+        Ns_Log(Warning, "nsloopctl: no interp active");
+    }
+    Ns_Log(Warning, "nsloopctl: abort");
+    CountEvent(COUNT_ABORTS);
+
+    return TCL_ERROR;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * MonitorThread, StopMonitor --
+ *
+ *      Monitor thread of a virtual server, started when
+ *      "monitorinterval" is configured, and its shutdown procedure.
+ *      Every interval, the thread makes a single pass over the loops
+ *      of all shards and checks the loops of its server for progress.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Stalled loops and hogs are logged and possibly canceled or
+ *      aborted, see MonitorLoop.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+MonitorThread(void *arg)
+{
+    ServerData     *serverPtr = arg;
+    Tcl_HashSearch  search;
+    Tcl_HashEntry  *hPtr;
+    LoopData       *loopPtr;
+    Ns_Time         now, until;
+    unsigned int    i;
+
+    Ns_ThreadSetName("-nsloopctl:monitor-");
+    Ns_Log(Notice, "nsloopctl: monitor thread started, interval " NS_TIME_FMT,
+           (int64_t)serverPtr->monitorInterval.sec, serverPtr->monitorInterval.usec);
+
+    Ns_MutexLock(&serverPtr->monitorLock);
+    while (!serverPtr->monitorStop) {
+        Ns_GetTime(&until);
+        Ns_IncrTime(&until, serverPtr->monitorInterval.sec, serverPtr->monitorInterval.usec);
+        while (!serverPtr->monitorStop
+               && Ns_CondTimedWait(&serverPtr->monitorCond, &serverPtr->monitorLock,
+                                   &until) != NS_TIMEOUT) {
+            ;
+        }
+        if (serverPtr->monitorStop) {
+            break;
+        }
+        Ns_MutexUnlock(&serverPtr->monitorLock);
+
+        Ns_GetTime(&now);
+        for (i = 0u; i < LOOPCTL_SHARDS; i++) {
+            Shard *shardPtr = &shards[i];
+
+            Ns_MutexLock(&shardPtr->lock);
+            hPtr = Tcl_FirstHashEntry(&shardPtr->loops, &search);
+            while (hPtr != NULL) {
+                loopPtr = Tcl_GetHashValue(hPtr);
+                if (loopPtr->serverPtr == serverPtr) {
+                    MonitorLoop(loopPtr, &now);
+                }
+                hPtr = Tcl_NextHashEntry(&search);
+            }
+            ExpireEvals(shardPtr, &now);
+            Ns_MutexUnlock(&shardPtr->lock);
+        }
+
+        Ns_MutexLock(&serverPtr->monitorLock);
+    }
+    Ns_MutexUnlock(&serverPtr->monitorLock);
+
+    Ns_Log(Notice, "nsloopctl: monitor thread stopped");
+}
+
+static void
+StopMonitor(const Ns_Time *UNUSED(toPtr), void *arg)
+{
+    ServerData *serverPtr = arg;
+
+    Ns_MutexLock(&serverPtr->monitorLock);
+    serverPtr->monitorStop = NS_TRUE;
+    Ns_CondSignal(&serverPtr->monitorCond);
+    Ns_MutexUnlock(&serverPtr->monitorLock);
+    Ns_ThreadJoin(&serverPtr->monitorThread, NULL);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * MonitorLoop --
+ *
+ *      Check a loop for progress since the last pass of the monitor
+ *      thread. A loop which did not complete a spin for "stalltime"
+ *      is stalled, e.g. blocked inside an iteration, a loop which ran
+ *      more than "hograte" spins per second is a CPU hog. Paused loops
+ *      and loops running a nested loop which makes progress are not
+ *      stalled, and throttled loops are no hogs. Every episode
+ *      is logged and counted once and escalated as configured. Must
+ *      be called with the shard of the loop locked.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Loop might be canceled or its thread aborted.
+ *
+ *----------------------------------------------------------------------
+ */
+
+#define MONITOR_STALL 1u
+#define MONITOR_HOG   2u
+
+static void
+MonitorLoop(LoopData *loopPtr, const Ns_Time *nowPtr)
+{
+    const ServerData *serverPtr = loopPtr->serverPtr;
+    const LoopData   *innerPtr = loopPtr->threadPtr->loopPtr;
+    uint64_t          spins, delta;
+    Ns_Time           diff;
+    MonitorAction     action = MONITOR_LOG;
+    double            elapsed;
+    bool              progress;
+
+    spins = LOOPCTL_LOAD64(&loopPtr->spins);
+    delta = spins - loopPtr->monSpins;
+    progress = (delta > 0u);
+    if (!progress && innerPtr != loopPtr) {
+        /*
+         * An outer loop waits for its innermost registered loop, which
+         * made progress when its spins changed since its last check,
+         * or when it was found progressing earlier in this pass. Like
+         * a paused loop, its outer loops are not stalled.
+         */
+
+        progress = (LOOPCTL_LOAD64(&innerPtr->spins) != innerPtr->monSpins
+                    || Ns_DiffTime(&innerPtr->monProgress, &loopPtr->monTime, NULL) > 0
+                    || innerPtr->control == LOOP_PAUSE);
+    }
+    (void) Ns_DiffTime(nowPtr, &loopPtr->monTime, &diff);
+    elapsed = (double)diff.sec + (double)diff.usec / 1000000.0;
+    loopPtr->monSpins = spins;
+    loopPtr->monTime = *nowPtr;
+
+    if (progress) {
+        loopPtr->monProgress = *nowPtr;
+        loopPtr->monFlags &= ~MONITOR_STALL;
+    } else if ((loopPtr->monFlags & MONITOR_STALL) == 0u
+               && loopPtr->control != LOOP_PAUSE) {
+        (void) Ns_DiffTime(nowPtr, &loopPtr->monProgress, &diff);
+        if (Ns_DiffTime(&diff, &serverPtr->stallTime, NULL) >= 0) {
+            Ns_Log(Warning, "nsloopctl: loop %" PRIxPTR " stalled at spin %" PRIu64
+                   " for " NS_TIME_FMT "s: %s", loopPtr->lid, spins,
+                   (int64_t)diff.sec, diff.usec, Tcl_DStringValue(&loopPtr->args));
+            loopPtr->monFlags |= MONITOR_STALL;
+            CountEvent(COUNT_STALLS);
+            action = serverPtr->stallAction;
+        }
+    }
+
+    if (serverPtr->hogRate > 0 && elapsed > 0.0) {
+        double rate = (double)delta / elapsed;
+
+        if (rate < (double)serverPtr->hogRate || loopPtr->control == LOOP_THROTTLE) {
+            loopPtr->monFlags &= ~MONITOR_HOG;
+        } else if ((loopPtr->monFlags & MONITOR_HOG) == 0u) {
+            Ns_Log(Warning, "nsloopctl: loop %" PRIxPTR " hogging the CPU at %.0f spins/s: %s",
+                   loopPtr->lid, rate, Tcl_DStringValue(&loopPtr->args));
+            loopPtr->monFlags |= MONITOR_HOG;
+            CountEvent(COUNT_HOGS);
+            if (serverPtr->hogAction > action) {
+                action = serverPtr->hogAction;
+            }
+        }
+    }
+
+    if (action == MONITOR_CANCEL && loopPtr->control != LOOP_CANCEL) {
+        Ns_Log(Warning, "nsloopctl: canceling loop %" PRIxPTR, loopPtr->lid);
+        SendSignal(loopPtr, LOOP_CANCEL, NULL, NULL);
+    } else if (action == MONITOR_ABORT) {
+        Ns_Log(Warning, "nsloopctl: aborting thread of loop %" PRIxPTR, loopPtr->lid);
+        AbortThread(loopPtr->threadPtr);
+    }
+}
+
+#undef MONITOR_STALL
+#undef MONITOR_HOG
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * GetMonitorAction --
+ *
+ *      Read the escalation of a monitor condition from the module
+ *      configuration.
+ *
+ * Results:
+ *      Monitor action, MONITOR_LOG if unset or invalid.
+ *
+ * Side effects:
+ *      Invalid values are logged.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static MonitorAction
+GetMonitorAction(const char *section, const char *key)
+{
+    const char *value = Ns_ConfigString(section, key, "log");
+    size_t      i;
+
+    for (i = 0u; i < sizeof(monitorActions) / sizeof(monitorActions[0]); i++) {
+        if (STREQ(value, monitorActions[i])) {
+            return (MonitorAction)i;
+        }
+    }
+    Ns_Log(Warning, "nsloopctl: ignoring invalid %s: %s", key, value);
+
+    return MONITOR_LOG;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ThreadCleanup --
+ *
+ *      Delete per-thread context at thread exit time. The loop
+ *      profile of the thread is kept in its shard.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+ThreadCleanup(void *arg)
+{
+    ThreadData *threadPtr = arg;
+    Histogram  *histPtr;
+
+    Ns_MutexLock(&threadPtr->shardPtr->lock);
+    Tcl_DeleteHashEntry(threadPtr->hPtr);
+    MergeSites(&threadPtr->shardPtr->sites, &threadPtr->sites, &threadPtr->profileEpoch);
+    while ((histPtr = threadPtr->histPtr) != NULL) {
+        threadPtr->histPtr = histPtr->nextPtr;
+        MergeHistograms(&threadPtr->shardPtr->histPtr, histPtr);
+        ns_free(histPtr);
+    }
+    Ns_MutexUnlock(&threadPtr->shardPtr->lock);
+    FlushBodies(&threadPtr->bodies);
+    Tcl_DeleteHashTable(&threadPtr->bodies);
+    FreeSites(&threadPtr->sites);
+    FreeArena(&threadPtr->arena);
+
+    Tcl_AsyncDelete(threadPtr->cancel);
+    Ns_CondDestroy(&threadPtr->cond);
+    ns_free(threadPtr);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * GetLoop --
+ *
+ *      Get the loop data struct given it's ID and lock the registry
+ *      shard containing it.
+ *
+ * Results:
+ *      Pointer to LoopData or NULL if no such loop ID exists. On
+ *      success, the shard is returned locked in shardPtrPtr and must
+ *      be unlocked by the caller.
+ *
+ * Side effects:
+ *      Tcl error message left as interp result.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static LoopData *
+GetLoop(Tcl_Interp *interp, Tcl_Obj *objPtr, Shard **shardPtrPtr)
+{
+    return GetEntry(interp, objPtr, offsetof(Shard, loops), "loop id", shardPtrPtr);
+}
+
+static EvalData *
+GetEval(Tcl_Interp *interp, Tcl_Obj *objPtr, Shard **shardPtrPtr)
+{
+    return GetEntry(interp, objPtr, offsetof(Shard, evals), "eval handle", shardPtrPtr);
+}
+
+static void *
+GetEntry(Tcl_Interp *interp, Tcl_Obj *objPtr, size_t tableOffset, const char *what,
+         Shard **shardPtrPtr)
+{
+    Tcl_HashEntry *hPtr;
+    Shard         *shardPtr;
+    uintptr_t      id;
+
+    if (GetId(NULL, objPtr, &id) != TCL_OK) {
+        Tcl_AppendResult(interp, "no such ", what, ": ", Tcl_GetString(objPtr), NULL);
+        return NULL;
+    }
+    shardPtr = &shards[id & (LOOPCTL_SHARDS - 1u)];
+
+    Ns_MutexLock(&shardPtr->lock);
+    hPtr = Tcl_FindHashEntry((Tcl_HashTable *)((char *)shardPtr + tableOffset), (const char *)id);
+    if (hPtr == NULL) {
+        Ns_MutexUnlock(&shardPtr->lock);
+        Tcl_AppendResult(interp, "no such ", what, ": ", Tcl_GetString(objPtr), NULL);
+        return NULL;
+    }
+    *shardPtrPtr = shardPtr;
+
+    return Tcl_GetHashValue(hPtr);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * NewEntry --
+ *
+ *      Create an entry with a new unique ID in a table of the shard,
+ *      which must be locked. The shard index is encoded in the low
+ *      bits of the ID, such that GetEntry can find the shard.
+ *
+ * Results:
+ *      New hash entry, the ID is returned in idPtr.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static Tcl_HashEntry *
+NewEntry(Shard *shardPtr, Tcl_HashTable *tablePtr, uintptr_t *idPtr)
+{
+    Tcl_HashEntry *hPtr;
+    int            new;
+
+    do {
+        *idPtr = (shardPtr->next++ << LOOPCTL_SHARD_BITS) | (uintptr_t) (shardPtr - shards);
+        hPtr = Tcl_CreateHashEntry(tablePtr, (const char *)*idPtr, &new);
+    } while (!new);
+
+    return hPtr;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * NewIdObj, GetId --
+ *
+ *      Loop ids and eval handles are returned as objects of the type
+ *      "nsloopctl:id", which keep the integer id as internal rep. The
+ *      hex string is generated on demand, and an id passed back to a
+ *      control command is parsed only once.
+ *
+ * Results:
+ *      New object, or a standard Tcl result and the id in idPtr.
+ *
+ * Side effects:
+ *      Object may be converted to the id type.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static Tcl_Obj *
+NewIdObj(uintptr_t id)
+{
+    Tcl_Obj *objPtr = Tcl_NewObj();
+
+    Tcl_InvalidateStringRep(objPtr);
+    objPtr->internalRep.otherValuePtr = (void *)id;
+    objPtr->typePtr = &idType;
+
+    return objPtr;
+}
+
+static int
+GetId(Tcl_Interp *interp, Tcl_Obj *objPtr, uintptr_t *idPtr)
+{
+    if (objPtr->typePtr != &idType && Tcl_ConvertToType(interp, objPtr, &idType) != TCL_OK) {
+        return TCL_ERROR;
+    }
+    *idPtr = (uintptr_t)objPtr->internalRep.otherValuePtr;
+
+    return TCL_OK;
+}
+
+static int
+SetIdFromAny(Tcl_Interp *interp, Tcl_Obj *objPtr)
+{
+    const char *id = Tcl_GetString(objPtr);
+    char       *end;
+    uintptr_t   value;
+
+    if (!isxdigit(UCHAR(*id))) {
+        end = (char *)id;
+    } else {
+        value = (uintptr_t) strtoull(id, &end, 16);
+    }
+    if (end == id || *end != '\0') {
+        if (interp != NULL) {
+            Ns_TclPrintfResult(interp, "invalid id: %s", id);
+        }
+        return TCL_ERROR;
+    }
+    if (objPtr->typePtr != NULL && objPtr->typePtr->freeIntRepProc != NULL) {
+        objPtr->typePtr->freeIntRepProc(objPtr);
+    }
+    objPtr->internalRep.otherValuePtr = (void *)value;
+    objPtr->typePtr = &idType;
+
+    return TCL_OK;
+}
+
+static void
+UpdateStringOfId(Tcl_Obj *objPtr)
+{
+    char buf[TCL_INTEGER_SPACE * 2];
+    int  len;
+
+    len = snprintf(buf, sizeof(buf), "%" PRIxPTR, (uintptr_t)objPtr->internalRep.otherValuePtr);
+    objPtr->bytes = ckalloc((unsigned)len + 1u);
+    memcpy(objPtr->bytes, buf, (size_t)len + 1u);
+    objPtr->length = len;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * WaitEval --
+ *
+ *      Wait until an eval request has been completed or dropped, or
+ *      the timeout expires. Must be called with the shard of the
+ *      request locked.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Lock is released while waiting.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+WaitEval(EvalData *evalPtr, const Ns_Time *timeoutPtr)
+{
+    Ns_Time       timeout;
+    Ns_ReturnCode status = NS_OK;
+
+    Ns_GetTime(&timeout);
+    Ns_IncrTime(&timeout, timeoutPtr->sec, timeoutPtr->usec);
+    while (status == NS_OK
+           && (evalPtr->state == EVAL_WAIT || evalPtr->state == EVAL_RUN)) {
+        status = Ns_CondTimedWait(&evalPtr->cond, &evalPtr->shardPtr->lock, &timeout);
+    }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * EvalResult --
+ *
+ *      Leave the result of a completed eval request in the interp.
+ *      The result buffer is copied, since concurrent waiters on the
+ *      same handle share the request.
+ *
+ * Results:
+ *      Result code of the script, TCL_ERROR if the loop exited
+ *      before evaluating it.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+EvalResult(Tcl_Interp *interp, EvalData *evalPtr)
+{
+    int result;
+
+    if (evalPtr->state == EVAL_DROP) {
+        Tcl_SetObjResult(interp, Tcl_NewStringObj("dropped: loop exited", -1));
+        result = TCL_ERROR;
+    } else {
+        Tcl_SetObjResult(interp, Tcl_NewStringObj(Tcl_DStringValue(&evalPtr->result),
+                                                  Tcl_DStringLength(&evalPtr->result)));
+        result = evalPtr->code;
+    }
+
+    return result;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * GetScript --
+ *
+ *      Return the eval script as a Tcl_Obj from the script cache of
+ *      the interp, such that a script sent repeatedly is compiled
+ *      only once.
+ *
+ * Results:
+ *      Script object with an extra reference for the caller.
+ *
+ * Side effects:
+ *      The cache is flushed when it is full.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static Tcl_Obj *
+GetScript(Tcl_Interp *interp, const Tcl_DString *scriptPtr)
+{
+    Tcl_HashTable *tablePtr;
+    Tcl_HashEntry *hPtr;
+    Tcl_Obj       *objPtr;
+    int            new;
+
+    tablePtr = Tcl_GetAssocData(interp, "nsloopctl:scripts", NULL);
+    if (tablePtr == NULL) {
+        tablePtr = ns_malloc(sizeof(Tcl_HashTable));
+        Tcl_InitHashTable(tablePtr, TCL_STRING_KEYS);
+        Tcl_SetAssocData(interp, "nsloopctl:scripts", FreeScripts, tablePtr);
+    } else if (tablePtr->numEntries >= LOOPCTL_SCRIPTS
+               && Tcl_FindHashEntry(tablePtr, scriptPtr->string) == NULL) {
+        FlushScripts(tablePtr);
+    }
+
+    hPtr = Tcl_CreateHashEntry(tablePtr, scriptPtr->string, &new);
+    if (new) {
+        objPtr = Tcl_NewStringObj(scriptPtr->string, scriptPtr->length);
+        Tcl_IncrRefCount(objPtr);
+        Tcl_SetHashValue(hPtr, objPtr);
+    } else {
+        objPtr = Tcl_GetHashValue(hPtr);
+    }
+    Tcl_IncrRefCount(objPtr);
+
+    return objPtr;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * FlushScripts, FreeScripts --
+ *
+ *      Remove all scripts from the script cache of an interp, and
+ *      free the cache when the interp is deleted.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+FlushScripts(Tcl_HashTable *tablePtr)
+{
+    Tcl_HashSearch  search;
+    Tcl_HashEntry  *hPtr;
+
+    hPtr = Tcl_FirstHashEntry(tablePtr, &search);
+    while (hPtr != NULL) {
+        Tcl_DecrRefCount((Tcl_Obj *)Tcl_GetHashValue(hPtr));
+        Tcl_DeleteHashEntry(hPtr);
+        hPtr = Tcl_NextHashEntry(&search);
+    }
+}
+
+static void
+FreeScripts(ClientData clientData, Tcl_Interp *UNUSED(interp))
+{
+    Tcl_HashTable *tablePtr = clientData;
+
+    FlushScripts(tablePtr);
+    Tcl_DeleteHashTable(tablePtr);
+    ns_free(tablePtr);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ReleaseEval --
+ *
+ *      Drop a reference to an eval request, and free it with the last
+ *      reference into the arena of the current thread. Must be called
+ *      with the shard of the request locked.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+ReleaseEval(EvalData *evalPtr)
+{
+    if (--evalPtr->refCount == 0) {
+        ThreadData *threadPtr = Ns_TlsGet(&tls);
+
+        ArenaFreeString(threadPtr, &evalPtr->script);
+        ArenaFreeString(threadPtr, &evalPtr->result);
+        Ns_CondDestroy(&evalPtr->cond);
+        ArenaFree(threadPtr, evalPtr);
+    }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ExpireEvals --
+ *
+ *      Release the async eval handles of a shard whose result was not
+ *      collected within the "evaltimeout" after completion. Must be
+ *      called with the shard locked.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Expired results are dropped and counted as eval timeouts.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+ExpireEvals(Shard *shardPtr, const Ns_Time *nowPtr)
+{
+    Tcl_HashSearch  search;
+    Tcl_HashEntry  *hPtr;
+    EvalData       *evalPtr;
+    Ns_Time         diff;
+
+    hPtr = Tcl_FirstHashEntry(&shardPtr->evals, &search);
+    while (hPtr != NULL) {
+        evalPtr = Tcl_GetHashValue(hPtr);
+        hPtr = Tcl_NextHashEntry(&search);
+
+        if ((evalPtr->state == EVAL_DONE || evalPtr->state == EVAL_DROP)
+            && Ns_DiffTime(nowPtr, &evalPtr->doneTime, &diff) >= 0
+            && Ns_DiffTime(&diff, &evalPtr->keepTime, NULL) > 0) {
+            Tcl_DeleteHashEntry(evalPtr->hPtr);
+            evalPtr->hPtr = NULL;
+            CountEvent(COUNT_EVAL_TIMEOUTS);
+            ReleaseEval(evalPtr);
+        }
+    }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * GetStatus --
+ *
+ *      Return the status name of a loop control state as used by
+ *      loopctl_info and loopctl_stats.
+ *
+ * Results:
+ *      Static string.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static const char *
+GetStatus(LoopControl control)
+{
+    const char *desc;
+
+    switch (control) {
+    case LOOP_RUN:
+        desc = "running";
+        break;
+    case LOOP_PAUSE:
+        desc = "paused";
+        break;
+    case LOOP_CANCEL:
+        desc = "canceled";
+        break;
+    case LOOP_THROTTLE:
+        desc = "throttled";
+        break;
+    default:
+        desc = "";
+        break;
     }
 
-    /*
-     * Break up the value lists and variable lists into elements
-     */
+    return desc;
+}
 
-    maxj = 0;
-    for (i = 0;  i < numLists;  i++) {
-        result = Tcl_ListObjGetElements(interp, argObjv[1+i*2],
-                                        &varcList[i], &varvList[i]);
-        if (result != TCL_OK) {
-            goto done;
-        }
-        if (varcList[i] < 1) {
-            Tcl_AppendToObj(Tcl_GetObjResult(interp),
-                            "foreach varlist is empty", -1);
-            result = TCL_ERROR;
-            goto done;
-        }
 
-        result = Tcl_ListObjGetElements(interp, argObjv[2+i*2],
-                                        &argcList[i], &argvList[i]);
-        if (result != TCL_OK) {
-            goto done;
-        }
+/*
+ *----------------------------------------------------------------------
+ *
+ * InitSelector, MatchLoop --
+ *
+ *      Validate the selection criteria and test a loop against them.
+ *      The loops of a thread are all registered in the shard of the
+ *      thread, so only this shard has to be visited when selecting by
+ *      thread.
+ *
+ * Results:
+ *      InitSelector returns a standard Tcl result, MatchLoop returns
+ *      NS_TRUE if the loop matches and its run time in elapsedPtr.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
 
-        j = argcList[i] / varcList[i];
-        if ((argcList[i] % varcList[i]) != 0) {
-            j++;
-        }
-        if (j > maxj) {
-            maxj = j;
+static int
+InitSelector(Tcl_Interp *interp, Selector *selPtr)
+{
+    char *end;
+
+    selPtr->first = 0u;
+    selPtr->last = LOOPCTL_SHARDS - 1u;
+    if (selPtr->thread != NULL) {
+        selPtr->tid = (uintptr_t) strtoull(selPtr->thread, &end, 16);
+        if (*selPtr->thread == '\0' || *end != '\0') {
+            Ns_TclPrintfResult(interp, "invalid thread id: %s", selPtr->thread);
+            return TCL_ERROR;
         }
+        selPtr->first = selPtr->last = (unsigned int)(GetShard(selPtr->tid) - shards);
     }
+    Ns_GetTime(&selPtr->now);
 
-    /*
-     * Iterate maxj times through the lists in parallel
-     * If some value lists run out of values, set loop vars to ""
-     */
+    return TCL_OK;
+}
 
-    bodyPtr = argObjv[objc-1];
-    for (j = 0;  j < maxj;  j++) {
-        for (i = 0;  i < numLists;  i++) {
-            /*
-             * Refetch the list members; we assume that the sizes are
-             * the same, but the array of elements might be different
-             * if the internal rep of the objects has been lost and
-             * recreated (it is too difficult to accurately tell when
-             * this happens, which can lead to some weird crashes,
-             * like Bug #494348...)
-             */
+static bool
+MatchLoop(const LoopData *loopPtr, const Selector *selPtr, Ns_Time *elapsedPtr)
+{
+    if ((selPtr->thread != NULL && loopPtr->tid != selPtr->tid)
+        || LOOPCTL_LOAD64(&loopPtr->spins) < (uint64_t)selPtr->minSpins) {
+        return NS_FALSE;
+    }
+    (void) Ns_DiffTime(&selPtr->now, &loopPtr->etime, elapsedPtr);
+    if (selPtr->minElapsedPtr != NULL && Ns_DiffTime(elapsedPtr, selPtr->minElapsedPtr, NULL) < 0) {
+        return NS_FALSE;
+    }
+    if (selPtr->pattern != NULL && !Tcl_StringMatch(loopPtr->args.string, selPtr->pattern)) {
+        return NS_FALSE;
+    }
 
-            result = Tcl_ListObjGetElements(interp, argObjv[1+i*2],
-                                            &varcList[i], &varvList[i]);
-            if (result != TCL_OK) {
-                Tcl_Panic("nsloopctl: ForeachObjCmd: could not reconvert variable list %ld to a list object\n", (long)i);
-            }
-            result = Tcl_ListObjGetElements(interp, argObjv[2+i*2],
-                                            &argcList[i], &argvList[i]);
-            if (result != TCL_OK) {
-                Tcl_Panic("nsloopctl: ForeachObjCmd: could not reconvert value list %ld to a list object\n", (long)i);
-            }
+    return NS_TRUE;
+}
 
-            for (v = 0;  v < varcList[i];  v++) {
-                int k = index[i]++;
-                Tcl_Obj *valuePtr, *varValuePtr;
 
-                if (k < argcList[i]) {
-                    valuePtr = argvList[i][k];
-                } else {
-                    valuePtr = Tcl_NewObj(); /* empty string */
-                }
-                Tcl_IncrRefCount(valuePtr);
-                varValuePtr = Tcl_ObjSetVar2(interp, varvList[i][v],
-                                             NULL, valuePtr, 0);
-                Tcl_DecrRefCount(valuePtr);
-                if (varValuePtr == NULL) {
-                    Tcl_ResetResult(interp);
-                    Tcl_AppendStringsToObj(Tcl_GetObjResult(interp),
-                                           "couldn't set loop variable: \"",
-                                           Tcl_GetString(varvList[i][v]), "\"", (char *) NULL);
-                    result = TCL_ERROR;
-                    goto done;
-                }
+/*
+ *----------------------------------------------------------------------
+ *
+ * GetShard --
+ *
+ *      Map a thread id to its registry shard.
+ *
+ * Results:
+ *      Pointer to Shard.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
 
-            }
-        }
+static Shard *
+GetShard(uintptr_t id)
+{
+    uint64_t hash = (uint64_t) id * UINT64_C(0x9E3779B97F4A7C15);
 
-        result = CheckControl(interp, &data);
+    return &shards[hash >> (64 - LOOPCTL_SHARD_BITS)];
+}
 
-        if (result == TCL_OK) {
-            result = Tcl_EvalObjEx(interp, bodyPtr, 0);
-        }
-        if (result != TCL_OK) {
-            if (result == TCL_CONTINUE) {
-                result = TCL_OK;
-            } else if (result == TCL_BREAK) {
-                result = TCL_OK;
-                break;
-            } else if (result == TCL_ERROR) {
-                char msg[32 + TCL_INTEGER_SPACE];
 
-                sprintf(msg, "\n    (\"foreach\" body line %d)",
-                        Tcl_GetErrorLine(interp));
-                Tcl_AddObjErrorInfo(interp, msg, -1);
-                break;
-            } else {
-                break;
-            }
-        }
-    }
-    if (result == TCL_OK) {
-        Tcl_ResetResult(interp);
-    }
+/*
+ *----------------------------------------------------------------------
+ *
+ * GetThreadData --
+ *
+ *      Return the per-thread context, allocating it and registering
+ *      the thread in its shard on first use.
+ *
+ * Results:
+ *      Pointer to ThreadData.
+ *
+ * Side effects:
+ *      Thread might be added to the threads table.
+ *
+ *----------------------------------------------------------------------
+ */
 
- done:
-    if (numLists > STATIC_LIST_SIZE) {
-        ckfree((char *) index);
-        ckfree((char *) varcList);
-        ckfree((char *) argcList);
-        ckfree((char *) varvList);
-        ckfree((char *) argvList);
-    }
-    if (argObjv != argObjStorage) {
-        ckfree((char *) argObjv);
-    }
+static ThreadData *
+GetThreadData(void)
+{
+    ThreadData *threadPtr;
 
-    LeaveLoop(&data);
+    threadPtr = Ns_TlsGet(&tls);
+    if (threadPtr == NULL) {
+        uintptr_t tid = Ns_ThreadId();
+        char      id[32];
+        int       new;
 
-    return result;
+        threadPtr = ns_malloc(sizeof(ThreadData));
+        threadPtr->cancel = Tcl_AsyncCreate(ThreadAbort, threadPtr);
+        Ns_CondInit(&threadPtr->cond);
+        threadPtr->shardPtr = GetShard(tid);
+        threadPtr->loopPtr = NULL;
+        threadPtr->outerPtr = NULL;
+        threadPtr->cancelDepth = 0u;
+        threadPtr->abortSent.sec = threadPtr->abortAck.sec = 0;
+        threadPtr->abortSent.usec = threadPtr->abortAck.usec = 0;
+        threadPtr->attention = 0;
+        threadPtr->abort = NS_FALSE;
+        threadPtr->limited = NS_FALSE;
+#ifdef LOOPCTL_CPUTIME
+        threadPtr->haveClock = (pthread_getcpuclockid(pthread_self(), &threadPtr->clock) == 0);
+#endif
+        Ns_GetTime(&threadPtr->start);
+        GetCpuTime(threadPtr, &threadPtr->cpuStart);
+        Tcl_InitHashTable(&threadPtr->sites, (int)LOOPCTL_SITE_KEY);
+        Tcl_InitHashTable(&threadPtr->bodies, (int)LOOPCTL_BODY_KEY);
+        threadPtr->profileEpoch = 0u;
+        threadPtr->histPtr = NULL;
+        memset(&threadPtr->arena, 0, sizeof(threadPtr->arena));
+        snprintf(id, sizeof(id), "%" PRIxPTR, tid);
+        Ns_MutexLock(&threadPtr->shardPtr->lock);
+        threadPtr->hPtr = Tcl_CreateHashEntry(&threadPtr->shardPtr->threads, id, &new);
+        Tcl_SetHashValue(threadPtr->hPtr, threadPtr);
+        Ns_MutexUnlock(&threadPtr->shardPtr->lock);
+        Ns_TlsSet(&tls, threadPtr);
+    }
 
-#undef STATIC_LIST_SIZE
-#undef NUM_ARGS
+    return threadPtr;
 }
 
-
+
 /*
  *----------------------------------------------------------------------
  *
- * EnterLoop --
+ * ArenaAlloc, ArenaFree --
  *
- *      Add entry for the LoopData structure when a "for" or
- *      "while" command starts.
+ *      Allocate and free a block of memory from the free lists of a
+ *      thread. ArenaFree accepts blocks of any thread and a NULL
+ *      threadPtr, in which case the block is returned to the system.
  *
  * Results:
- *      None.
+ *      Pointer to memory of at least size bytes (ArenaAlloc).
  *
  * Side effects:
- *      Loop can be monitored and possibly canceled by "loopctl_*".
+ *      None.
  *
  *----------------------------------------------------------------------
  */
 
-static void
-EnterLoop(LoopData *loopPtr, TCL_SIZE_T objc, Tcl_Obj * const objv[])
+static void *
+ArenaAlloc(ThreadData *threadPtr, size_t size)
 {
-    TCL_SIZE_T i;
-    int new;
-    static unsigned int next = 0;
+    Arena  *arenaPtr = &threadPtr->arena;
+    Block  *blockPtr;
+    size_t  cls = 0u, blockSize = LOOPCTL_ARENA_MIN;
+
+    size += sizeof(Block);
+    while (blockSize < size && cls < LOOPCTL_ARENA_CLASSES) {
+        blockSize <<= 1;
+        cls++;
+    }
+    if (cls == LOOPCTL_ARENA_CLASSES) {
+        blockPtr = ns_malloc(size);
+    } else if ((blockPtr = arenaPtr->blocks[cls]) != NULL) {
+        arenaPtr->blocks[cls] = blockPtr->nextPtr;
+        arenaPtr->nblocks[cls]--;
+    } else {
+        blockPtr = ns_malloc(blockSize);
+    }
+    blockPtr->cls = cls;
 
-    loopPtr->control = LOOP_RUN;
-    loopPtr->spins = 0;
-    loopPtr->tid = Ns_ThreadId();
-    loopPtr->evalPtr = NULL;
-    Ns_GetTime(&loopPtr->etime);
+    return blockPtr + 1;
+}
 
-    /* NB: Must copy strings in case loop body updates or invalidates them. */
+static void
+ArenaFree(ThreadData *threadPtr, void *ptr)
+{
+    Block  *blockPtr = (Block *)ptr - 1;
+    size_t  cls = blockPtr->cls;
 
-    Tcl_DStringInit(&loopPtr->args);
-    for (i = 0; i < objc; ++i) {
-        Tcl_DStringAppendElement(&loopPtr->args, Tcl_GetString(objv[i]));
+    if (threadPtr == NULL
+        || cls == LOOPCTL_ARENA_CLASSES
+        || threadPtr->arena.nblocks[cls] == LOOPCTL_ARENA_KEEP) {
+        ns_free(blockPtr);
+    } else {
+        blockPtr->nextPtr = threadPtr->arena.blocks[cls];
+        threadPtr->arena.blocks[cls] = blockPtr;
+        threadPtr->arena.nblocks[cls]++;
     }
-
-    Ns_MutexLock(&lock);
-    do {
-        snprintf(loopPtr->lid, sizeof(loopPtr->lid),
-                 "%" PRIxPTR, (intptr_t) next++);
-        loopPtr->hPtr = Tcl_CreateHashEntry(&loops, loopPtr->lid, &new);
-    } while (!new);
-
-    Tcl_SetHashValue(loopPtr->hPtr, loopPtr);
-    Ns_MutexUnlock(&lock);
 }
 
-
+
 /*
  *----------------------------------------------------------------------
  *
- * LeaveLoop --
+ * ArenaInitString, ArenaFreeString --
  *
- *      Remove entry for the LoopData structure when a "for" or
- *      "while" command exits.
+ *      Initialize a Tcl_DString with a recycled buffer of the thread,
+ *      if any, and keep the buffer of a Tcl_DString for reuse when
+ *      freeing it. Only buffers up to the largest size class are
+ *      kept, threadPtr may be NULL as for ArenaFree.
  *
  * Results:
  *      None.
  *
  * Side effects:
- *      None.
+ *      The Tcl_DString is left initialized and empty.
  *
  *----------------------------------------------------------------------
  */
 
 static void
-LeaveLoop(LoopData *loopPtr)
+ArenaInitString(ThreadData *threadPtr, Tcl_DString *dsPtr)
 {
-    Ns_MutexLock(&lock);
-    if (loopPtr->evalPtr != NULL) {
-        loopPtr->evalPtr->state = EVAL_DROP;
-        Ns_CondBroadcast(&cond);
+    Arena *arenaPtr = &threadPtr->arena;
+
+    Tcl_DStringInit(dsPtr);
+    if (arenaPtr->nstrings > 0u) {
+        arenaPtr->nstrings--;
+        dsPtr->string = arenaPtr->strings[arenaPtr->nstrings];
+        dsPtr->spaceAvl = arenaPtr->sizes[arenaPtr->nstrings];
+        dsPtr->string[0] = '\0';
     }
-    Tcl_DeleteHashEntry(loopPtr->hPtr);
-    Ns_MutexUnlock(&lock);
-    Tcl_DStringFree(&loopPtr->args);
 }
 
-
+static void
+ArenaFreeString(ThreadData *threadPtr, Tcl_DString *dsPtr)
+{
+    if (threadPtr != NULL
+        && dsPtr->string != dsPtr->staticSpace
+        && dsPtr->spaceAvl <= (TCL_SIZE_T)(LOOPCTL_ARENA_MIN << (LOOPCTL_ARENA_CLASSES - 1u))
+        && threadPtr->arena.nstrings < LOOPCTL_ARENA_KEEP) {
+        Arena *arenaPtr = &threadPtr->arena;
+
+        arenaPtr->strings[arenaPtr->nstrings] = dsPtr->string;
+        arenaPtr->sizes[arenaPtr->nstrings] = dsPtr->spaceAvl;
+        arenaPtr->nstrings++;
+        Tcl_DStringInit(dsPtr);
+    } else {
+        Tcl_DStringFree(dsPtr);
+    }
+}
+
+
 /*
  *----------------------------------------------------------------------
  *
- * CheckControl --
+ * FreeArena --
  *
- *      Check for control flag within a loop of a cancel or pause.
+ *      Release the recycled memory of a thread at thread exit.
  *
  * Results:
- *      TCL_OK if not canceled, TCL_ERROR otherwise.
+ *      None.
  *
  * Side effects:
- *      Leave cancel message as interp result.
+ *      None.
  *
  *----------------------------------------------------------------------
  */
 
-static int
-CheckControl(Tcl_Interp *interp, LoopData *loopPtr)
+static void
+FreeArena(Arena *arenaPtr)
 {
-    Tcl_DString  script;
-    char        *str;
-    int          result;
-    TCL_SIZE_T   len;
+    Block       *blockPtr;
+    unsigned int i;
 
-    Ns_MutexLock(&lock);
-    ++loopPtr->spins;
-    while (loopPtr->evalPtr != NULL || loopPtr->control == LOOP_PAUSE) {
-        if (loopPtr->evalPtr != NULL) {
-            Tcl_DStringInit(&script);
-            Tcl_DStringAppend(&script, loopPtr->evalPtr->script.string,
-                              loopPtr->evalPtr->script.length);
-            Ns_MutexUnlock(&lock);
-            result = Tcl_EvalEx(interp, script.string, script.length, 0);
-            Tcl_DStringFree(&script);
-            if (result != TCL_OK) {
-                Ns_TclLogErrorInfo(interp, "nsloopctl");
-            }
-            Ns_MutexLock(&lock);
-            if (loopPtr->evalPtr == NULL) {
-                Ns_Log(Error, "nsloopctl: dropped result: %s", Tcl_GetStringResult(interp));
-            } else {
-                str = Tcl_GetStringFromObj(Tcl_GetObjResult(interp), &len);
-                Tcl_DStringAppend(&loopPtr->evalPtr->result, str, len);
-                loopPtr->evalPtr->state = EVAL_DONE;
-                loopPtr->evalPtr = NULL;
-                Ns_CondBroadcast(&cond);
-            }
-        }
-        if (loopPtr->control == LOOP_PAUSE) {
-            Ns_CondWait(&cond, &lock);
+    for (i = 0u; i < LOOPCTL_ARENA_CLASSES; i++) {
+        while ((blockPtr = arenaPtr->blocks[i]) != NULL) {
+            arenaPtr->blocks[i] = blockPtr->nextPtr;
+            ns_free(blockPtr);
         }
     }
-    if (loopPtr->control == LOOP_CANCEL) {
-        Tcl_SetObjResult(interp, Tcl_NewStringObj("nsloopctl: loop canceled: returning TCL_ERROR", -1));
-        result = TCL_ERROR;
-    } else {
-        result = TCL_OK;
+    for (i = 0u; i < arenaPtr->nstrings; i++) {
+        ckfree(arenaPtr->strings[i]);
     }
-    Ns_MutexUnlock(&lock);
-
-    return result;
 }
 
-
+
 /*
  *----------------------------------------------------------------------
  *
- * ThreadAbort --
+ * CountEvent --
  *
- *      Callback which aborts Tcl execution in which ever interp is
- *      currently running in the given thread.
+ *      Increment an event counter in the shard of the current thread.
  *
  * Results:
- *      Always TCL_ERROR.
+ *      None.
  *
  * Side effects:
  *      None.
@@ -1113,83 +5863,110 @@ CheckControl(Tcl_Interp *interp, LoopData *loopPtr)
  *----------------------------------------------------------------------
  */
 
-static int
-ThreadAbort(ClientData UNUSED(clientData), Tcl_Interp *interp, int UNUSED(code))
+static void
+CountEvent(Counter counter)
 {
-    if (interp != NULL) {
-        Tcl_ResetResult(interp);
-        Tcl_SetObjResult(interp, Tcl_NewStringObj("nsloopctl: async thread abort: returning TCL_ERROR", -1));
-    } else {
-        Ns_Log(Warning, "nsloopctl: no interp active");
-    }
-    Ns_Log(Warning, "nsloopctl: abort");
-
-    return TCL_ERROR;
+    LOOPCTL_INCR(&GetShard(Ns_ThreadId())->counts[counter]);
 }
 
-
+
 /*
  *----------------------------------------------------------------------
  *
- * ThreadCleanup --
+ * LogEvent --
  *
- *      Delete per-thread context at thread exit time.
+ *      Append a lifecycle event of a registered loop to the event log
+ *      of its virtual server. May be called from any thread, as long
+ *      as the loop can not exit meanwhile.
  *
  * Results:
  *      None.
  *
  * Side effects:
- *      None.
+ *      The oldest event is overwritten when the log is full.
  *
  *----------------------------------------------------------------------
  */
 
 static void
-ThreadCleanup(void *arg)
+LogEvent(EventType type, const LoopData *loopPtr)
 {
-    ThreadData *threadPtr = arg;
-
-    Ns_MutexLock(&lock);
-    Tcl_DeleteHashEntry(threadPtr->hPtr);
-    Ns_MutexUnlock(&lock);
+    EventLog *logPtr = loopPtr->serverPtr->eventLogPtr;
+    Event    *slotPtr;
+    uint64_t  seq;
+    size_t    len;
 
-    Tcl_AsyncDelete(threadPtr->cancel);
-    ns_free(threadPtr);
+    if (logPtr == NULL) {
+        return;
+    }
+    seq = LOOPCTL_CLAIM64(&logPtr->head);
+    slotPtr = &logPtr->slots[(seq - 1u) & logPtr->mask];
+
+    LOOPCTL_STORE64(&slotPtr->seq, 0u);
+    LOOPCTL_FENCE_RELEASE();
+    Ns_GetTime(&slotPtr->time);
+    slotPtr->lid = loopPtr->lid;
+    slotPtr->tid = loopPtr->tid;
+    slotPtr->spins = LOOPCTL_LOAD64(&loopPtr->spins);
+    slotPtr->type = type;
+    len = (size_t)loopPtr->args.length;
+    if (len >= LOOPCTL_EVENT_CMD) {
+        len = LOOPCTL_EVENT_CMD - 1u;
+        while (len > 0u && ((unsigned char)loopPtr->args.string[len] & 0xC0u) == 0x80u) {
+            len--;
+        }
+    }
+    memcpy(slotPtr->command, loopPtr->args.string, len);
+    slotPtr->command[len] = '\0';
+    LOOPCTL_RELEASE64(&slotPtr->seq, seq);
 }
 
-
+
 /*
  *----------------------------------------------------------------------
  *
- * GetLoop --
+ * GetCpuTime --
  *
- *      Get the loop data struct given it's ID.
+ *      Read the CPU time consumed by a thread. The thread might be a
+ *      different one than the caller, but must not exit meanwhile.
  *
  * Results:
- *      Pointer to LoopData or NULL if no such loop ID exists.
+ *      None.
  *
  * Side effects:
- *      Tcl error message left as interp result.
+ *      None.
  *
  *----------------------------------------------------------------------
  */
 
-static LoopData *
-GetLoop(Tcl_Interp *interp, Tcl_Obj *objPtr)
+static void
+GetCpuTime(const ThreadData *threadPtr, Ns_Time *timePtr)
 {
-    char          *id;
-    Tcl_HashEntry *hPtr;
-    LoopData      *loopPtr;
+#ifdef LOOPCTL_CPUTIME
+    struct timespec ts;
 
-    id = Tcl_GetString(objPtr);
-    hPtr = Tcl_FindHashEntry(&loops, id);
-    if (hPtr == NULL) {
-        Tcl_AppendResult(interp, "no such loop id: ", id, NULL);
-        return NULL;
+    if (threadPtr->haveClock && clock_gettime(threadPtr->clock, &ts) == 0) {
+        timePtr->sec = ts.tv_sec;
+        timePtr->usec = ts.tv_nsec / 1000;
+        return;
     }
-    loopPtr = Tcl_GetHashValue(hPtr);
+#else
+    (void) threadPtr;
+#endif
+    timePtr->sec = 0;
+    timePtr->usec = 0;
+}
+
+static double
+CpuRatio(const Ns_Time *cpuPtr, const Ns_Time *startPtr, const Ns_Time *nowPtr)
+{
+    Ns_Time wall;
+    double  secs;
+
+    (void) Ns_DiffTime(nowPtr, startPtr, &wall);
+    secs = (double)wall.sec + (double)wall.usec / 1000000.0;
 
-    return loopPtr;
+    return secs > 0.0 ? ((double)cpuPtr->sec + (double)cpuPtr->usec / 1000000.0) / secs : 0.0;
 }
 
 
@@ -0,0 +1,141 @@
+#
+# The contents of this file are subject to the Mozilla Public License
+# Version 1.1 (the "License"); you may not use this file except in
+# compliance with the License. You may obtain a copy of the License at
+# http://aolserver.com/.
+#
+# Software distributed under the License is distributed on an "AS IS"
+# basis, WITHOUT WARRANTY OF ANY KIND, either express or implied. See
+# the License for the specific language governing rights and limitations
+# under the License.
+#
+# The Original Code is AOLserver Code and related documentation
+# distributed by AOL.
+# 
+# The Initial Developer of the Original Code is America Online,
+# Inc. Portions created by AOL are Copyright (C) 1999 America Online,
+# Inc. All Rights Reserved.
+#
+# Alternatively, the contents of this file may be used under the terms
+# of the GNU General Public License (the "GPL"), in which case the
+# provisions of GPL are applicable instead of those above.  If you wish
+# to allow use of your version of this file only under the terms of the
+# GPL and not to allow others to use your version of this file under the
+# License, indicate your decision by deleting the provisions above and
+# replace them with the notice and other provisions required by the GPL.
+# If you do not delete the provisions above, a recipient may use your
+# version of this file under either the License or the GPL.
+# 
+#
+# $Header$
+#
+
+
+#
+# bench.tcl --
+#
+#       Microbenchmarks of the monitored loop commands. Run it via
+#       "make bench", which invokes nsd once with the stock Tcl loop
+#       commands and once with the nsloopctl replacements. Every result
+#       is printed as a single line of the form
+#
+#           bench <mode> <command> <size> <lists> <threads> <ns/iter>
+#
+#       where mode is "tcl" or "nsloopctl", size is the number of
+#       iterations per loop and lists is the number of lists iterated
+#       in parallel by foreach. The ns/iter value is the wall clock time
+#       per iteration averaged over all threads, so it includes the time
+#       slicing of threads exceeding the number of CPUs. Options:
+#
+#           -iterations n   Iterations per thread and case (100000)
+#           -threads list   Numbers of concurrent threads (1 8 64)
+#
+
+array set opts {-iterations 100000 -threads {1 8 64}}
+array set opts $argv
+
+#
+# A loop is counted by loopctl_metrics only when it is run by one of
+# the replacement commands.
+#
+
+set loops [dict get [loopctl_metrics] loops]
+foreach x {1} {}
+set mode [expr {[dict get [loopctl_metrics] loops] > $loops ? "nsloopctl" : "tcl"}]
+
+#
+# The loops are run in procs of a fresh thread interp, such that the
+# stock commands are byte-compiled as in production code.
+#
+
+set procs {
+    proc bench_for {size repeat} {
+        for {set r 0} {$r < $repeat} {incr r} {
+            for {set i 0} {$i < $size} {incr i} {}
+        }
+    }
+    proc bench_while {size repeat} {
+        set r 0
+        while {$r < $repeat} {
+            set i 0
+            while {$i < $size} {incr i}
+            incr r
+        }
+    }
+    proc bench_foreach {size repeat lists} {
+        #
+        # Spell out the lists, since a foreach with expanded arguments
+        # is not byte-compiled.
+        #
+        set args ""
+        for {set j 0} {$j < $lists} {incr j} {
+            append args " v$j \$l"
+        }
+        proc bench_foreach_lists {l repeat} [string map [list @ARGS@ $args] {
+            for {set r 0} {$r < $repeat} {incr r} {
+                foreach @ARGS@ {}
+            }
+        }]
+        bench_foreach_lists [lrepeat $size x] $repeat
+    }
+}
+
+proc bench {command size lists threads} {
+    global opts mode procs
+
+    set repeat [expr {max(1, $opts(-iterations) / $size)}]
+    if {$command eq "foreach"} {
+        set call [list bench_foreach $size $repeat $lists]
+    } else {
+        set call [list bench_$command $size $repeat]
+    }
+    set tids {}
+    for {set t 0} {$t < $threads} {incr t} {
+        lappend tids [ns_thread begin [list apply {{procs call t} {
+            eval $procs
+            nsv_set bench $t [lindex [time $call] 0]
+        }} $procs $call $t]]
+    }
+    set usec 0
+    foreach tid $tids {
+        ns_thread join $tid
+    }
+    for {set t 0} {$t < $threads} {incr t} {
+        incr usec [nsv_get bench $t]
+    }
+    set nsiter [expr {1000.0 * $usec / ($threads * $repeat * $size)}]
+    puts [format "bench %s %s %d %d %d %.2f" $mode $command $size $lists $threads $nsiter]
+}
+
+foreach threads $opts(-threads) {
+    foreach command {for while} {
+        foreach size {10 1000 100000} {
+            bench $command $size 1 $threads
+        }
+    }
+    foreach lists {1 2 4} {
+        foreach size {10 1000 100000} {
+            bench foreach $size $lists $threads
+        }
+    }
+}
@@ -24,3 +24,34 @@ ns_section "ns/server/server1/tcl"
 ns_param   initfile        ${bindir}/init.tcl
 ns_param   library         $homedir/tests/testserver/modules
 
+
+ns_section "ns/server/server1/module/nsloop"
+
+#
+# Enable the optional features for the tests, but not for "make bench",
+# which measures the default configuration.
+#
+
+if {![info exists ::env(NSLOOPCTL_BENCH)]} {
+    ns_param   profile         true
+    ns_param   histograms      true
+    ns_param   monitorinterval 200ms
+    ns_param   stalltime       1s
+    ns_param   limitcommands   1000
+}
+
+#
+# Allow "make bench" to run with the stock Tcl loop commands.
+#
+
+if {[info exists ::env(NSLOOPCTL_COMMANDS)]} {
+    ns_param   commands        $::env(NSLOOPCTL_COMMANDS)
+}
+
+#
+# Let the loops register late for the loop-2.* tests, see "make test".
+#
+
+if {[info exists ::env(NSLOOPCTL_REGISTERAFTER)]} {
+    ns_param   registerafter   $::env(NSLOOPCTL_REGISTERAFTER)
+}